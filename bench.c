@@ -0,0 +1,217 @@
+#define _GNU_SOURCE
+#define _XOPEN_SOURCE
+#define _XOPEN_SOURCE_EXTENDED
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "mett.h"
+
+/* Microbenchmarks of the editing core, run with "make bench". Every result
+ * is printed as a line of JSON. Allocations are counted by wrapping malloc,
+ * calloc and realloc at link time (only those made by mett itself). */
+
+struct Corpus {
+	const char *name;
+	void (*gen)(FILE*);
+};
+
+struct Counters {
+	size_t allocs, bytes;
+};
+
+static void genshort(FILE*);
+static void genlong(FILE*);
+static void genunicode(FILE*);
+static unsigned brand();
+static long long now();
+static void report(const char*, const char*, size_t, size_t, long long, const struct Counters*);
+static void run(const struct Corpus*, const char*);
+
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void*, size_t);
+
+static struct Counters counters;
+static unsigned seed = 1;
+
+static const struct Corpus corpora[] = {
+	{ "short",   genshort },   /* Many short lines of code-like text */
+	{ "long",    genlong },    /* A few huge lines */
+	{ "unicode", genunicode }, /* Lines of mostly multibyte characters */
+};
+
+int main() {
+	char dir[] = "/tmp/mett-bench.XXXXXX";
+	size_t i;
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	for (i = 0; i < sizeof(corpora) / sizeof(struct Corpus); ++i)
+		run(&corpora[i], dir);
+	rmdir(dir);
+	return 0;
+}
+
+void *__wrap_malloc(size_t n) {
+	counters.allocs++;
+	counters.bytes += n;
+	return __real_malloc(n);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+	counters.allocs++;
+	counters.bytes += n * size;
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t n) {
+	counters.allocs++;
+	counters.bytes += n;
+	return __real_realloc(p, n);
+}
+
+void genshort(FILE *fp) {
+	/* 1M lines of 0 to 79 characters, indented like code */
+	int i, j;
+	for (i = 0; i < 1000000; ++i) {
+		int len = brand() % 80;
+		for (j = 0; j < len; ++j)
+			fputc(j < 4 * (int)(brand() % 3) ? '\t' : 'a' + brand() % 26, fp);
+		fputc('\n', fp);
+	}
+}
+
+void genlong(FILE *fp) {
+	/* 8 lines of 4 MiB each */
+	int i, j;
+	for (i = 0; i < 8; ++i) {
+		for (j = 0; j < 4 << 20; ++j)
+			fputc(brand() % 8 ? 'a' + brand() % 26 : ' ', fp);
+		fputc('\n', fp);
+	}
+}
+
+void genunicode(FILE *fp) {
+	/* 200k lines of 40 characters of 1 to 4 bytes */
+	static const char *chars[] = { "a", "é", "ж", "中", "😀", " " };
+	int i, j;
+	for (i = 0; i < 200000; ++i) {
+		for (j = 0; j < 40; ++j)
+			fputs(chars[brand() % 6], fp);
+		fputc('\n', fp);
+	}
+}
+
+unsigned brand() {
+	/* The corpora are the same on every run */
+	seed = seed * 1103515245 + 12345;
+	return seed >> 16;
+}
+
+long long now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+void report(const char *corpus, const char *bench, size_t ops, size_t bytes, long long ns,
+		const struct Counters *start) {
+	printf("{\"corpus\":\"%s\",\"bench\":\"%s\",\"ops\":%zu,\"bytes\":%zu,\"ns\":%lld,"
+		"\"mb_per_s\":%.1f,\"ops_per_s\":%.0f,\"allocs\":%zu,\"alloc_bytes\":%zu}\n",
+		corpus, bench, ops, bytes, ns,
+		bytes / 1048576.0 / (ns / 1e9), ops / (ns / 1e9),
+		counters.allocs - start->allocs, counters.bytes - start->bytes);
+	fflush(stdout);
+}
+
+void run(const struct Corpus *c, const char *dir) {
+	char path[256], out[256];
+	struct Buffer *buf;
+	struct Counters start;
+	struct stat st;
+	long long t;
+	size_t size, i, n;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s.txt", dir, c->name);
+	snprintf(out, sizeof(out), "%s/%s.out", dir, c->name);
+	if (!(fp = fopen(path, "w"))) {
+		perror(path);
+		return;
+	}
+	c->gen(fp);
+	fclose(fp);
+	stat(path, &st);
+	size = st.st_size;
+
+	/* Read the whole file */
+	start = counters;
+	t = now();
+	curbuf = buf = mnewbuf(true);
+	mreadfile(buf, path);
+	report(c->name, "read", 1, size, now() - t, &start);
+
+	/* Jump around, and walk line by line */
+	start = counters;
+	t = now();
+	for (i = 0; i < 100000; ++i)
+		mmove(buf, brand() % 64, (int)(brand() % buf->numlines) - buf->cursor.c.y);
+	for (i = 0; i < 100000; ++i)
+		mmove(buf, 0, i < 50000 ? +1 : -1);
+	report(c->name, "move", 200000, 0, now() - t, &start);
+
+	/* Find the column of random places on random lines */
+	start = counters;
+	n = 0;
+	t = now();
+	for (i = 0; i < 100000; ++i) {
+		mmove(buf, 0, (int)(brand() % buf->numlines) - buf->cursor.c.y);
+		n += mnumcols(buf, buf->curline, brand() % (buf->curline->nchars + 1));
+	}
+	report(c->name, "columns", 100000, 0, now() - t, &start);
+
+	/* Type text at random places */
+	start = counters;
+	mode = MODE_INSERT;
+	n = 0;
+	t = now();
+	for (i = 0; i < 1000; ++i) {
+		const char *s = "for (i = 0; i < n; ++i)\n\tsum += ä[i];\n";
+		mmove(buf, brand() % 64, (int)(brand() % buf->numlines) - buf->cursor.c.y);
+		while (*s) {
+			wchar_t wc;
+			s += mutf8dec(s, &wc);
+			minsert(buf, wc);
+			n++;
+		}
+	}
+	report(c->name, "insert", n, 0, now() - t, &start);
+	mode = MODE_NORMAL;
+
+	/* Search for text that isn't there, once with a literal to look for first */
+	mmove(buf, 0, -buf->numlines);
+	start = counters;
+	t = now();
+	mfind(buf, "qqqqz");
+	report(c->name, "find", 1, size, now() - t, &start);
+	start = counters;
+	t = now();
+	mfind(buf, "[0-9]z");
+	report(c->name, "find-regex", 1, size, now() - t, &start);
+
+	/* Write it out again */
+	start = counters;
+	t = now();
+	msave(buf, out);
+	report(c->name, "save", 1, size, now() - t, &start);
+
+	mfreebuf(buf);
+	curbuf = NULL;
+	unlink(out);
+	unlink(path);
+}
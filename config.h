@@ -1,3 +1,4 @@
+#ifndef METT_CORE
 #define VERSION_STRING ">Mett v0.1\n"
 #define ESC 27
 #define CTRL(x) ((x) & 0x1F)
@@ -8,6 +9,7 @@ enum ColorPair {
 	PAIR_STATUS_HIGHLIGHT,
 	PAIR_LINE_NUMBERS,
 	PAIR_BUFFER_CONTENTS,
+	PAIR_SEARCH_MATCH,
 	NUM_COLOR_PAIRS
 };
 
@@ -17,7 +19,8 @@ const short color_pairs[NUM_COLOR_PAIRS][2] = {
 	{  COLOR_YELLOW,    COLOR_BG },
 	{  COLOR_GREEN,     COLOR_BG },
 	{  COLOR_YELLOW,    COLOR_BG },
-	{  0,               COLOR_WHITE }
+	{  0,               COLOR_WHITE },
+	{  0,               COLOR_CYAN }
 };
 
 const char manual_path[] = "readme.txt";
@@ -48,11 +51,13 @@ const struct Action buffer_actions[] = {
 	{  NULL,        L'&',          jump,        { .m = MARKER_MIDDLE } },
 	{  NULL,        L'$',          jump,        { .m = MARKER_END } },
 	{  L"coc",      L'C',          coc,         {{ 0 }} },
+	{  L"goto",     0,             gotoline,    {{ 0 }} },
 
 	/* Buffer management */
 	{  L"bn",       CTRL('n'),     bufsel,      { .i = +1 } },
 	{  L"bp",       CTRL('p'),     bufsel,      { .i = -1 } },
 	{  L"bd",       CTRL('x'),     bufdel,      { .i = 0 } },
+	{  L"b",        0,             bufnum,      {{ 0 }} },
 	{  L"cls",      0,             cls,         {{ 0 }} },
 	{  L"edit",     L'e',          readfile,    {{ 0 }} },
 	{  L"read",     L'r',          readstr,     {{ 0 }} },
@@ -68,6 +73,7 @@ const struct Action buffer_actions[] = {
 
 	/* File I/O */
 	{  L"write",    CTRL('w'),     save,        { .v = NULL } },
+	{  L"recover",  0,             recover,     {{ 0 }} },
 	{  L"manual",   L'?',          readfile,    { .v = (void*)manual_path } },
 	{  L"help",     L'?',          readfile,    { .v = (void*)manual_path } },
 
@@ -78,10 +84,22 @@ const struct Action buffer_actions[] = {
 	{  L"del",      KEY_DC,        insert,      { .i = KEY_DC } },
 	{  L"append",   L'A',          append,      {{ 0 }} },
 	{  L"newln",    L'o',          newln,       {{ 0 }} },
+	{  L"undo",     L'u',          undo,        { .i = -1 } },
+	{  L"redo",     CTRL('r'),     undo,        { .i = +1 } },
+
+	/* Selection */
+	{  L"cut",      L'd',          cut,         {{ 0 }} },
+	{  L"yank",     L'y',          yank,        {{ 0 }} },
+	{  L"put",      L'P',          put,         {{ 0 }} },
+	{  L"indent",   L'>',          shift,       { .i = +1 } },
+	{  L"dedent",   L'<',          shift,       { .i = -1 } },
+	{  L"pipe",     L'|',          pipesel,     {{ 0 }} },
 
 	/* Misc */
+	{  L"again",    L'@',          again,       {{ 0 }} },
 	{  L"print",    L'p',          print,       {{ 0 }} },
 	{  L"about",    0,             print,       { .v = (void*)VERSION_STRING } },
+	{  L"stats",    0,             stats,       {{ 0 }} },
 	{  L"quit",     L'q',          quit,        {{ 0 }} },
 	{  L"exit",     0,             quit,        {{ 0 }} },
 	{  NULL,        KEY_MOUSE,     handlemouse, {{ 0 }} },
@@ -90,23 +108,69 @@ const struct Action buffer_actions[] = {
 
 static bool use_colors = true;
 static bool line_numbers = true;
-static bool auto_indent = true;
+
+/* Ask the terminal to mark pasted text, so it is inserted as it is */
+static bool bracketed_paste = true;
 
 /* Always have the cursor at the center of the screen */
 static bool always_centered = false;
 
-/* Maximum size in bytes of a line. If exceeded, it has to be resized at a cost */
-static const unsigned default_linebuf_size = 1024;
-
-static const unsigned tab_width = 4;
+/* Wrap long lines onto the rows below instead of cutting them off */
+static bool soft_wrap = true;
 
 /* These control the tab visualisation */
 static const wchar_t tab_beginning = L'→';
 static const wchar_t tab_character = L' ';
 
-/* Copy buffer to backup_path before overwriting file */
-static const bool backup_on_write = true;
-static const char *backup_path = "/tmp/.mett-backup";
+/* Shell commands (!cmd) are polled this often (in ms) when idle */
+static const int job_poll_interval = 20;
 
 /* Maximum number of times a command can be repeated */
 static const unsigned max_cmd_repetition = 65536;
+
+/* Number of files edited at once by scripts (-s), 0 for one per CPU */
+static const int script_workers = 0;
+
+/* Latency of each stage of the editor is written here on quit, if set */
+static const char *stats_path = NULL;
+
+#else
+/* Settings of the editing core, core.c only sees these. The editor uses
+ * the ones that aren't static too. */
+
+bool auto_indent = true;
+
+/* Lines are allocated from blocks of this many bytes */
+static const size_t line_block_size = 1 << 18;
+
+/* Files are read and written in blocks of this many bytes */
+const size_t file_block_size = 1 << 16;
+
+/* Files of at least this many bytes are mapped instead of read, and their
+ * lines are only made when they are viewed or edited */
+static const size_t large_file_size = 64 << 20;
+
+const unsigned tab_width = 4;
+
+/* Copy buffer to backup_path before overwriting file */
+bool backup_on_write = true;
+static const char *backup_path = "/tmp/.mett-backup";
+
+/* Output of shell commands (!cmd) and pipes is read in steps of at most
+ * this many bytes between screen updates */
+const size_t job_read_budget = 1 << 20;
+
+/* Incremental search scans for at most this many ms between screen updates */
+static const int search_slice_time = 8;
+
+/* Undo history is allocated in blocks of undo_block_size bytes. Once a
+ * buffer's history grows beyond undo_limit bytes the oldest edits are dropped */
+static const size_t undo_block_size = 1 << 16;
+static const size_t undo_limit = 64 << 20;
+
+/* Edits are journaled to .name.mett-swp next to the file and synced this
+ * often (in ms). A journal left behind by a crash is only replayed on
+ * :recover, and a file of that name that isn't a journal is left alone. */
+bool swap_files = true;
+static const int swap_sync_interval = 1000;
+#endif
@@ -0,0 +1,2479 @@
+#define _GNU_SOURCE
+#define _XOPEN_SOURCE
+#define _XOPEN_SOURCE_EXTENDED
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+#include "mett.h"
+
+static unsigned mrand();
+
+static struct Region* mreadregion(FILE*);
+static struct Region* mmapregion(const char*, size_t, int*);
+
+static struct Line* mnewline(struct Buffer*, size_t);
+static int  mclass(size_t);
+static void mrelease(struct Buffer*, struct Line*);
+static struct Line* mresizeline(struct Buffer*, struct Line*, size_t);
+static struct Line* mreserve(struct Buffer*, struct Line*, size_t);
+static struct Line* mlocate(struct Buffer*, int, int*);
+static struct Line* msplit(struct Buffer*, struct Line*, int);
+static char* mspanline(struct Buffer*, struct Line*, int, size_t*);
+static void miterat(struct Buffer*, struct Iter*, int);
+static void mitertext(struct Buffer*, struct Iter*);
+static void miternext(struct Buffer*, struct Iter*);
+static int  mweight(struct Line*);
+static int  mnumln(struct Line*);
+static void mrotate(struct Buffer*, struct Line*);
+static void mlinkln(struct Buffer*, struct Line*, struct Line*);
+static void munlinkln(struct Buffer*, struct Line*);
+static struct Line* mbuildindex(struct Line**, int, unsigned);
+static void msplitindex(struct Line*, int, struct Line**, struct Line**);
+static struct Line* mmergeindex(struct Line*, struct Line*);
+static void mlinklines(struct Buffer*, struct Line*, struct Line*, struct Line*, int);
+static void mcutlines(struct Buffer*, struct Line*, struct Line*);
+static int  mcount(const char*, size_t, bool*);
+static void mscanln(struct Line*);
+static void mtouch(struct Line*, int);
+static struct Cols* mcols(struct Buffer*, struct Line*, int);
+static void mfreecols(struct Buffer*, struct Line*);
+static int  mcolsof(struct Line*, size_t*);
+static int  mindent(struct Line*, int);
+static void mfeedstart(struct Buffer*, int);
+static void mfeedstop(struct Feed*);
+static void mappend(struct Buffer*, const char*, size_t);
+static bool mmemmem(const char*, size_t);
+static bool mmatch(const char*, size_t, size_t, regmatch_t*);
+static void mliteral(const char*);
+static void mshowmatch(struct Buffer*, int, size_t, size_t);
+static bool mwrite(int, const char*, size_t);
+static bool mwriteblk(int, char*, size_t*, const char*, size_t);
+static void mcopyfile(const char*, const char*);
+static void mrecord(struct Buffer*, bool, int, size_t, const char*, size_t);
+static void mswapopen(struct Buffer*, const char*);
+static bool mswapcreate(struct Buffer*);
+static int  mswapreplay(struct Buffer*, const char*, size_t);
+static void mswaprec(struct Buffer*, bool, int, size_t, const char*, size_t);
+static void mswapsaved(struct Buffer*, const char*);
+static void mswapclose(struct Buffer*);
+static void* mswapthread(void*);
+static size_t mputnum(char*, size_t);
+static bool mgetnum(const char**, const char*, size_t*);
+static void mforget(struct Buffer*);
+static void mdelete(struct Buffer*, int, size_t, size_t);
+static void mgoto(struct Buffer*, int, size_t);
+
+/* Global variables */
+enum Mode mode = MODE_NORMAL;
+struct Buffer *curbuf, *cmdbuf;
+struct Buffers buffers;
+struct Feed *feeds;
+struct Pattern pattern;
+struct Search search;
+unsigned editseq;
+bool undoing;
+bool dying; /* Swap files are kept for recovery when we are killed */
+int viewrows; /* Height of the buffer window, 0 without a terminal */
+static struct Swaps swaps = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, false, NULL };
+
+/* Only the settings of the core */
+#define METT_CORE
+#include "config.h"
+
+int32_t min(int32_t a, int32_t b) {
+	return a < b ? a : b;
+}
+
+int32_t max(int32_t a, int32_t b) {
+	return a > b ? a : b;
+}
+
+unsigned mrand() {
+	/* xorshift32, only used for the line index priorities */
+	static unsigned state = 2463534242u;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+struct Buffer* mnewbuf(bool listed) {
+	/* Create new buffer, listed ones are added to the end of the table */
+	struct Buffer *buf;
+	if (!(buf = (struct Buffer*)calloc(sizeof(struct Buffer), 1))) return NULL;
+	buf->idx = -1;
+	buf->offsetx = 4;
+	buf->painty = buf->paintstarty = buf->paintstartrow = -1;
+	mdirty(buf, 0, INT_MAX);
+	mselect(buf, -1, -1, -1, -1);
+
+	if (listed) {
+		if (buffers.len == buffers.size) {
+			buffers.size = buffers.size * 2 + 16;
+			buffers.list = realloc(buffers.list, buffers.size * sizeof(struct Buffer*));
+			assert(buffers.list);
+		}
+		buf->idx = buffers.len;
+		buffers.list[buffers.len++] = buf;
+	}
+	return buf;
+}
+
+void mfreebuf(struct Buffer *buf) {
+	/* Close a buffer and everything still working on it. If it is the
+	 * current one, the buffer that takes its place becomes current. */
+	struct Feed *f, *next;
+	int i;
+
+	for (f = feeds; f; f = next) {
+		next = f->next;
+		if (f->buf == buf) mfeedstop(f);
+	}
+	if (search.buf == buf) msearchend();
+	mswapclose(buf);
+
+	if (buf->idx >= 0) {
+		for (i = buf->idx + 1; i < buffers.len; ++i)
+			(buffers.list[i - 1] = buffers.list[i])->idx = i - 1;
+		buffers.len--;
+		if (buf == curbuf)
+			curbuf = buffers.len ? buffers.list[min(buf->idx, buffers.len - 1)] : NULL;
+	}
+
+	free(buf->path);
+	mclearbuf(buf);
+	free(buf);
+}
+
+void mclearbuf(struct Buffer *buf) {
+	struct Chunk *c;
+	mforget(buf);
+	while (buf->regions) {
+		struct Region *next = buf->regions->next;
+		if (buf->regions->marks) {
+			munmap(buf->regions->data, buf->regions->len);
+			free(buf->regions->marks);
+		}
+		free(buf->regions);
+		buf->regions = next;
+	}
+
+	/* All lines go at once with the pool */
+	while ((c = buf->pool.chunks)) {
+		buf->pool.chunks = c->next;
+		free(c);
+	}
+	while ((c = buf->pool.large)) {
+		buf->pool.large = c->next;
+		free(c);
+	}
+	while (buf->pool.cols) {
+		struct Cols *next = buf->pool.cols->next;
+		free(buf->pool.cols);
+		buf->pool.cols = next;
+	}
+	memset(&buf->pool, 0, sizeof(buf->pool));
+
+	buf->cursor.c.x = buf->cursor.c.y = 0;
+	buf->numlines = 0;
+	buf->changes = 0;
+	buf->root = buf->curline = NULL;
+	buf->gen++;
+	mdirty(buf, 0, INT_MAX);
+}
+
+struct Region* mreadregion(FILE *fp) {
+	/* Read the whole file block by block into a single region */
+	struct Region *r = NULL;
+	size_t n, size = 0;
+
+	do {
+		if (!r || r->len + file_block_size > size) {
+			size_t len = r ? r->len : 0;
+			size = size * 2 + file_block_size;
+			r = realloc(r, sizeof(struct Region) + size + 1);
+			assert(r);
+			r->len = len;
+		}
+		r->len += (n = fread(r->buf + r->len, 1, file_block_size, fp));
+	} while (n);
+
+	if (!r->len) {
+		free(r);
+		return NULL;
+	}
+	r = realloc(r, sizeof(struct Region) + r->len + 1);
+	assert(r);
+	r->buf[r->len] = 0;
+	r->data = r->buf;
+	r->marks = NULL;
+	r->nmarks = 0;
+	return r;
+}
+
+struct Region* mmapregion(const char *path, size_t size, int *numlines) {
+	/* Map a large file instead of reading it, and only note where every
+	 * MARK_STEP-th line starts */
+	struct Region *r;
+	char *map, *p, *nl, *end;
+	size_t n = 0, size_marks = 64;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) return NULL;
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return NULL;
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	r = malloc(sizeof(struct Region));
+	assert(r);
+	r->data = map;
+	r->len = size;
+	r->marks = malloc(size_marks * sizeof(size_t));
+	assert(r->marks);
+	r->marks[0] = 0;
+	r->nmarks = 1;
+
+	end = map + size;
+	for (p = map; (nl = memchr(p, '\n', end - p)); p = nl + 1) {
+		if (++n % MARK_STEP) continue;
+		if (r->nmarks == size_marks) {
+			size_marks *= 2;
+			r->marks = realloc(r->marks, size_marks * sizeof(size_t));
+			assert(r->marks);
+		}
+		r->marks[r->nmarks++] = nl + 1 - map;
+	}
+	/* The pages were only needed for counting */
+	madvise(map, size, MADV_DONTNEED);
+	madvise(map, size, MADV_NORMAL);
+	*numlines = n + 1;
+	return r;
+}
+
+int mreadfile(struct Buffer *buf, const char *path) {
+	FILE *fp = NULL;
+	struct Region *r = NULL;
+	struct stat st;
+	int n, fd = -1;
+
+	/* Pipes are read bit by bit while editing, they may never end */
+	if (path[0] == '-' && !path[1]) {
+		if (!fstat(STDIN_FILENO, &st) && S_ISFIFO(st.st_mode)) fd = STDIN_FILENO;
+		else fp = stdin;
+	} else if (!stat(path, &st) && S_ISFIFO(st.st_mode)) {
+		/* Don't wait for a writer to show up */
+		fd = open(path, O_RDONLY | O_NONBLOCK);
+	} else if (!stat(path, &st) && S_ISREG(st.st_mode) && (size_t)st.st_size >= large_file_size
+			&& (r = mmapregion(path, st.st_size, &n))) {
+		/* A single span stands for all lines until they are needed */
+		struct Line *span = mnewline(buf, 0);
+		r->next = buf->regions;
+		buf->regions = r;
+		span->span = true;
+		span->data = r->data;
+		span->len = r->len;
+		span->nchars = n;
+		mlinkln(buf, buf->curline, span);
+	} else {
+		fp = fopen(path, "r");
+	}
+
+	if (fp && (r = mreadregion(fp))) {
+		/* Split the region into lines that point straight into it.
+		 * They are only copied once they get modified. */
+		struct Line *head = NULL, *tail = NULL;
+		char *p, *nl, *end = r->data + r->len;
+		int numlines = 0;
+
+		r->next = buf->regions;
+		buf->regions = r;
+
+		for (p = r->data; ; p = nl + 1) {
+			struct Line *ln = mnewline(buf, 0);
+			if (!(nl = memchr(p, '\n', end - p))) nl = end;
+			*nl = 0;
+			ln->data = p;
+			ln->len = nl - p;
+			mscanln(ln);
+			ln->prev = tail;
+			if (tail) tail->next = ln;
+			else head = ln;
+			tail = ln;
+			numlines++;
+			if (nl == end) break;
+		}
+
+		/* Insert the new lines after the current one and index them all */
+		if (head) {
+			struct Line *ln = buf->curline, *first = head;
+			if (ln) {
+				first = mfirstline(buf);
+				tail->next = ln->next;
+				if (ln->next) ln->next->prev = tail;
+				ln->next = head;
+				head->prev = ln;
+			}
+			/* Spans stand for many lines, so count the nodes themselves */
+			buf->numlines += numlines;
+			for (n = 0, tail = first; tail; tail = tail->next) n++;
+			buf->root = mbuildindex(&first, n, UINT_MAX);
+			buf->root->parent = NULL;
+			buf->gen++;
+		}
+	}
+
+	/* Edits made before can't be undone across the new text */
+	mforget(buf);
+	if (fd < 0 && fp != stdin) mswapopen(buf, path);
+	buf->curline = mgetline(buf, 0);
+	buf->cursor.c.x = buf->cursor.c.y = buf->starty = buf->startrow = 0;
+	mdirty(buf, 0, INT_MAX);
+	free(buf->path);
+	buf->path = (char*)calloc(strlen(path)+1, 1);
+	strcpy(buf->path, path);
+	if (fp) fclose(fp);
+	if (fd >= 0) mfeedstart(buf, fd);
+
+	return 1;
+}
+
+void mreadstr(struct Buffer *buf, const char *str) {
+	int m = mode;
+	mode = MODE_INSERT;
+	while (*str) {
+		wchar_t c;
+		str += mutf8dec(str, &c);
+		minsert(buf, c);
+	}
+	mode = m;
+}
+
+struct Line* mnewline(struct Buffer *buf, size_t size) {
+	/* Allocate a line with room for at least size bytes from the buffer's
+	 * pool. With size 0 it has none and borrows its text. */
+	struct Pool *pool = &buf->pool;
+	struct Line *ln;
+	int c = mclass(size);
+
+	if (c < 0) {
+		/* Large lines get a chunk of their own */
+		struct Chunk *ch = malloc(sizeof(struct Chunk) + sizeof(struct Line) + size);
+		assert(ch);
+		ch->prev = NULL;
+		ch->next = pool->large;
+		if (pool->large) pool->large->prev = ch;
+		pool->large = ch;
+		ln = (struct Line*)ch->data;
+	} else if ((ln = pool->free[c])) {
+		pool->free[c] = ln->next;
+		size = c ? (size_t)8 << c : 0;
+	} else {
+		struct Chunk *ch = pool->chunks;
+		size_t n = (sizeof(struct Line) + (c ? (size_t)8 << c : 0) + 15) & ~(size_t)15;
+		if (!ch || ch->len + n > ch->size) {
+			ch = malloc(sizeof(struct Chunk) + line_block_size);
+			assert(ch);
+			ch->len = 0;
+			ch->size = line_block_size;
+			ch->next = pool->chunks;
+			pool->chunks = ch;
+		}
+		ln = (struct Line*)(ch->data + ch->len);
+		ch->len += n;
+		size = c ? (size_t)8 << c : 0;
+	}
+
+	memset(ln, 0, sizeof(struct Line));
+	ln->backbuf_size = size;
+	ln->ascii = true;
+	ln->data = ln->buf;
+	if (size) ln->buf[0] = 0;
+	return ln;
+}
+
+int mclass(size_t size) {
+	/* Size class for size bytes of text, -1 if it is too large */
+	int c = 1;
+	if (!size) return 0;
+	while (c < LINE_CLASSES && ((size_t)8 << c) < size) c++;
+	return c < LINE_CLASSES ? c : -1;
+}
+
+void mrelease(struct Buffer *buf, struct Line *ln) {
+	/* Give a line's memory back to the pool */
+	struct Pool *pool = &buf->pool;
+	int c = mclass(ln->backbuf_size);
+
+	mfreecols(buf, ln);
+	if (c < 0) {
+		struct Chunk *ch = (struct Chunk*)((char*)ln - offsetof(struct Chunk, data));
+		if (ch->prev) ch->prev->next = ch->next;
+		else pool->large = ch->next;
+		if (ch->next) ch->next->prev = ch->prev;
+		free(ch);
+	} else {
+		ln->next = pool->free[c];
+		pool->free[c] = ln;
+	}
+}
+
+void mfreeln(struct Buffer *buf, struct Line *ln) {
+	struct Line *next;
+
+	if (!ln) return;
+	next = ln->next ? mnext(buf, ln) : mprev(buf, ln);
+	munlinkln(buf, ln);
+
+	if (ln == buf->curline) {
+		buf->curline = next;
+		buf->cursor.c.y = next ? mlineno(next) : 0;
+	}
+
+	mrelease(buf, ln);
+}
+
+struct Line* mresizeline(struct Buffer *buf, struct Line *ln, size_t size) {
+	/* Move the line to the next size class that fits. Lines are copied
+	 * out of their region the same way before they get modified. */
+	bool left = ln->parent && ln->parent->left == ln;
+	struct Line *old = ln;
+
+	ln = mnewline(buf, size);
+	size = ln->backbuf_size;
+	*ln = *old;
+	ln->backbuf_size = size;
+	ln->data = ln->buf;
+	memcpy(ln->data, old->data, old->len + 1);
+	old->cols = NULL;
+	mrelease(buf, old);
+	buf->gen++;
+
+	/* The line has moved, update everything pointing to it */
+	if (ln->prev) ln->prev->next = ln;
+	if (ln->next) ln->next->prev = ln;
+	if (ln->left) ln->left->parent = ln;
+	if (ln->right) ln->right->parent = ln;
+	if (!ln->parent) buf->root = ln;
+	else if (left) ln->parent->left = ln;
+	else ln->parent->right = ln;
+	return ln;
+}
+
+struct Line* mreserve(struct Buffer *buf, struct Line *ln, size_t size) {
+	/* Make sure ln owns its data and has room for size bytes */
+	size_t n = ln->backbuf_size ? ln->backbuf_size : ln->len + 1;
+	if (ln->backbuf_size && n >= size) return ln;
+	while (n < size) n *= 2;
+	return mresizeline(buf, ln, n);
+}
+
+struct Line* mfirstline(struct Buffer *buf) {
+	struct Line *ln = buf->root;
+	while (ln && ln->left)
+		ln = ln->left;
+	return ln;
+}
+
+int mweight(struct Line *ln) {
+	return ln ? ln->weight : 0;
+}
+
+struct Line* mgetline(struct Buffer *buf, int n) {
+	/* Look up the nth line (starting at 0), lines still in a span are
+	 * only made when they are needed */
+	int k;
+	struct Line *ln = mlocate(buf, n, &k);
+	return ln && ln->span ? msplit(buf, ln, k) : ln;
+}
+
+struct Line* mlocate(struct Buffer *buf, int n, int *k) {
+	/* Find the line or span holding the nth line, and its index in there */
+	struct Line *ln = buf->root;
+	while (ln) {
+		int l = mweight(ln->left);
+		if (n < l) {
+			ln = ln->left;
+		} else if (n < l + mnumln(ln)) {
+			break;
+		} else {
+			n -= l + mnumln(ln);
+			ln = ln->right;
+		}
+	}
+	*k = n - mweight(ln ? ln->left : NULL);
+	return ln;
+}
+
+struct Line* msplit(struct Buffer *buf, struct Line *span, int k) {
+	/* Take line k out of a span, the lines around it stay spans */
+	int dirty0 = buf->dirty0, dirty1 = buf->dirty1, n = span->nchars;
+	struct Line *prev = span->prev, *ln;
+	char *end = span->data + span->len;
+	size_t len;
+	char *p = mspanline(buf, span, k, &len);
+
+	ln = mnewline(buf, len + 1);
+	memcpy(ln->data, p, len);
+	ln->data[len] = 0;
+	ln->len = len;
+	mscanln(ln);
+
+	munlinkln(buf, span);
+	if (k) {
+		span->len = p - 1 - span->data;
+		span->nchars = k;
+		mlinkln(buf, prev, span);
+		prev = span;
+	}
+	mlinkln(buf, prev, ln);
+	if (k + 1 < n) {
+		struct Line *rest = k ? mnewline(buf, 0) : span;
+		rest->span = true;
+		rest->data = p + len + 1;
+		rest->len = end - rest->data;
+		rest->nchars = n - k - 1;
+		mlinkln(buf, ln, rest);
+	} else if (!k) {
+		mrelease(buf, span);
+	}
+
+	/* Nothing changed on screen */
+	buf->dirty0 = dirty0;
+	buf->dirty1 = dirty1;
+	return ln;
+}
+
+char* mspanline(struct Buffer *buf, struct Line *span, int k, size_t *len) {
+	/* Find line k of a span and its length */
+	char *p = span->data, *end = span->data + span->len, *nl;
+
+	if (k) {
+		struct Region *r = buf->regions;
+		size_t lo = 0, hi, y, off;
+
+		while (r && !(p >= r->data && p < r->data + r->len)) r = r->next;
+		assert(r && r->marks);
+
+		/* Number the span's first line from the last mark before it... */
+		off = p - r->data;
+		for (hi = r->nmarks; hi - lo > 1; ) {
+			size_t mid = (lo + hi) / 2;
+			if (r->marks[mid] <= off) lo = mid;
+			else hi = mid;
+		}
+		y = lo * MARK_STEP + k;
+		for (nl = r->data + r->marks[lo]; (nl = memchr(nl, '\n', p - nl)); nl++) y++;
+
+		/* ...and count lines from the last mark before line k */
+		p = r->data + r->marks[y / MARK_STEP];
+		for (y %= MARK_STEP; y; y--)
+			p = (char*)memchr(p, '\n', end - p) + 1;
+	}
+	if (!(nl = memchr(p, '\n', end - p))) nl = end;
+	*len = nl - p;
+	return p;
+}
+
+struct Line* mnext(struct Buffer *buf, struct Line *ln) {
+	/* Line after ln, taken out of its span if needed */
+	struct Line *next = ln->next;
+	return next && next->span ? msplit(buf, next, 0) : next;
+}
+
+struct Line* mprev(struct Buffer *buf, struct Line *ln) {
+	struct Line *prev = ln->prev;
+	return prev && prev->span ? msplit(buf, prev, prev->nchars - 1) : prev;
+}
+
+void miterat(struct Buffer *buf, struct Iter *it, int y) {
+	/* Point the iterator at line y, without taking it out of its span */
+	it->y = y;
+	it->ln = mlocate(buf, y, &it->k);
+	it->gen = buf->gen;
+	mitertext(buf, it);
+}
+
+void mitertext(struct Buffer *buf, struct Iter *it) {
+	if (!it->ln) {
+		it->p = "";
+		it->len = 0;
+	} else if (it->ln->span) {
+		it->p = mspanline(buf, it->ln, it->k, &it->len);
+	} else {
+		it->p = it->ln->data;
+		it->len = it->ln->len;
+	}
+}
+
+void miternext(struct Buffer *buf, struct Iter *it) {
+	/* Go to the next line, wrapping around at the end of the buffer */
+	int y = it->y + 1 < buf->numlines ? it->y + 1 : 0;
+
+	if (it->gen != buf->gen || !it->ln) {
+		/* The lines have changed since, find our place again */
+		miterat(buf, it, y);
+		return;
+	}
+
+	it->y = y;
+	if (it->ln->span && ++it->k < it->ln->nchars) {
+		/* The lines of a span follow each other */
+		const char *end = it->ln->data + it->ln->len, *nl;
+		it->p += it->len + 1;
+		if (!(nl = memchr(it->p, '\n', end - it->p))) nl = end;
+		it->len = nl - it->p;
+		return;
+	}
+	it->k = 0;
+	if (!y || !(it->ln = it->ln->next)) it->ln = mfirstline(buf);
+	mitertext(buf, it);
+}
+
+int mnumln(struct Line *ln) {
+	/* Number of lines a node of the index stands for */
+	return ln->span ? ln->nchars : 1;
+}
+
+int mlineno(struct Line *ln) {
+	int n = mweight(ln->left);
+	for (; ln->parent; ln = ln->parent)
+		if (ln->parent->right == ln) n += mweight(ln->parent->left) + mnumln(ln->parent);
+	return n;
+}
+
+void mrotate(struct Buffer *buf, struct Line *ln) {
+	/* Rotate ln above its parent */
+	struct Line *p = ln->parent, *g = p->parent;
+	if (p->left == ln) {
+		if ((p->left = ln->right)) p->left->parent = p;
+		ln->right = p;
+	} else {
+		if ((p->right = ln->left)) p->right->parent = p;
+		ln->left = p;
+	}
+	p->parent = ln;
+	ln->parent = g;
+	if (!g) buf->root = ln;
+	else if (g->left == p) g->left = ln;
+	else g->right = ln;
+	p->weight = mweight(p->left) + mweight(p->right) + mnumln(p);
+	ln->weight = mweight(ln->left) + mweight(ln->right) + mnumln(ln);
+}
+
+void mlinkln(struct Buffer *buf, struct Line *prev, struct Line *ln) {
+	/* Insert ln after prev (or at the start if prev is NULL) */
+	struct Line *p;
+
+	ln->prev = prev;
+	ln->next = prev ? prev->next : mfirstline(buf);
+	if (ln->prev) ln->prev->next = ln;
+	if (ln->next) ln->next->prev = ln;
+
+	ln->left = ln->right = NULL;
+	ln->weight = mnumln(ln);
+	ln->prio = mrand();
+	if (ln->prev) mdirty(buf, mlineno(ln->prev), INT_MAX);
+	else mdirty(buf, 0, INT_MAX);
+	if (prev && !prev->right) {
+		prev->right = ln;
+		ln->parent = prev;
+	} else if ((p = prev ? prev->right : buf->root)) {
+		while (p->left) p = p->left;
+		p->left = ln;
+		ln->parent = p;
+	} else {
+		buf->root = ln;
+		ln->parent = NULL;
+	}
+
+	for (p = ln->parent; p; p = p->parent)
+		p->weight += mnumln(ln);
+	while (ln->parent && ln->parent->prio < ln->prio)
+		mrotate(buf, ln);
+	buf->numlines += mnumln(ln);
+	buf->gen++;
+}
+
+void munlinkln(struct Buffer *buf, struct Line *ln) {
+	struct Line *p;
+
+	mdirty(buf, mlineno(ln), INT_MAX);
+	if (ln->prev) ln->prev->next = ln->next;
+	if (ln->next) ln->next->prev = ln->prev;
+
+	/* Rotate the line down to a leaf, then cut it off */
+	while (ln->left || ln->right) {
+		if (!ln->right || (ln->left && ln->left->prio > ln->right->prio))
+			mrotate(buf, ln->left);
+		else
+			mrotate(buf, ln->right);
+	}
+	if (!(p = ln->parent)) buf->root = NULL;
+	else if (p->left == ln) p->left = NULL;
+	else p->right = NULL;
+	for (; p; p = p->parent)
+		p->weight -= mnumln(ln);
+	buf->numlines -= mnumln(ln);
+	buf->gen++;
+}
+
+struct Line* mbuildindex(struct Line **ln, int n, unsigned prio) {
+	/* Build a balanced index over the next n lines of a list in O(n).
+	 * Priorities decrease with depth so later insertions keep it a treap. */
+	struct Line *left, *root;
+
+	if (n <= 0) return NULL;
+	left = mbuildindex(ln, n / 2, prio >> 1);
+	root = *ln;
+	*ln = root->next;
+	root->prio = prio;
+	if ((root->left = left)) left->parent = root;
+	if ((root->right = mbuildindex(ln, n - n / 2 - 1, prio >> 1))) root->right->parent = root;
+	root->weight = mweight(root->left) + mweight(root->right) + mnumln(root);
+	return root;
+}
+
+void msplitindex(struct Line *t, int n, struct Line **l, struct Line **r) {
+	/* Split an index into its first n lines and the rest. The split has
+	 * to fall between two nodes, it doesn't go into spans. */
+	if (!t) {
+		*l = *r = NULL;
+		return;
+	}
+	if (n <= mweight(t->left)) {
+		msplitindex(t->left, n, l, &t->left);
+		if (t->left) t->left->parent = t;
+		*r = t;
+	} else {
+		msplitindex(t->right, n - mweight(t->left) - mnumln(t), &t->right, r);
+		if (t->right) t->right->parent = t;
+		*l = t;
+	}
+	t->parent = NULL;
+	t->weight = mweight(t->left) + mweight(t->right) + mnumln(t);
+}
+
+struct Line* mmergeindex(struct Line *a, struct Line *b) {
+	/* Join two indexes, the lines of a come before those of b */
+	if (!a || !b) return a ? a : b;
+	if (a->prio > b->prio) {
+		a->right = mmergeindex(a->right, b);
+		a->right->parent = a;
+		a->weight = mweight(a->left) + mweight(a->right) + mnumln(a);
+		return a;
+	}
+	b->left = mmergeindex(a, b->left);
+	b->left->parent = b;
+	b->weight = mweight(b->left) + mweight(b->right) + mnumln(b);
+	return b;
+}
+
+void mlinklines(struct Buffer *buf, struct Line *prev, struct Line *head, struct Line *tail, int n) {
+	/* Insert the n lines from head to tail after prev (or at the start if
+	 * prev is NULL). They get an index of their own that is spliced into
+	 * the buffer's. */
+	struct Line *l, *r, *ln = head;
+	int y = prev ? mlineno(prev) + mnumln(prev) : 0;
+
+	tail->next = prev ? prev->next : mfirstline(buf);
+	head->prev = prev;
+	if (tail->next) tail->next->prev = tail;
+	if (prev) prev->next = head;
+
+	msplitindex(buf->root, y, &l, &r);
+	buf->root = mmergeindex(mmergeindex(l, mbuildindex(&ln, n, mrand())), r);
+	buf->root->parent = NULL;
+	buf->numlines += n;
+	buf->gen++;
+	mdirty(buf, y, INT_MAX);
+}
+
+void mcutlines(struct Buffer *buf, struct Line *first, struct Line *last) {
+	/* Take the lines from first to last out of the list and the index in
+	 * one go. Spans among them are dropped without making their lines. */
+	int y = mlineno(first), n = mlineno(last) + mnumln(last) - y;
+	struct Line *l, *m, *r, *ln, *next;
+
+	msplitindex(buf->root, y, &l, &m);
+	msplitindex(m, n, &m, &r);
+	if ((buf->root = mmergeindex(l, r))) buf->root->parent = NULL;
+	if (first->prev) first->prev->next = last->next;
+	if (last->next) last->next->prev = first->prev;
+	buf->numlines -= n;
+	buf->gen++;
+	mdirty(buf, y, INT_MAX);
+
+	for (ln = first; ; ln = next) {
+		next = ln->next;
+		mrelease(buf, ln);
+		if (ln == last) break;
+	}
+}
+
+size_t mutf8len(const char *s) {
+	/* Length of the character at s, invalid bytes count as one character */
+	const unsigned char *u = (const unsigned char*)s;
+	size_t i, n;
+
+	if (u[0] < 0xC0) return 1;
+	else if (u[0] < 0xE0) n = 2;
+	else if (u[0] < 0xF0) n = 3;
+	else if (u[0] < 0xF8) n = 4;
+	else return 1;
+
+	for (i = 1; i < n; ++i)
+		if ((u[i] & 0xC0) != 0x80) return 1;
+	return n;
+}
+
+size_t mutf8dec(const char *s, wchar_t *c) {
+	const unsigned char *u = (const unsigned char*)s;
+	size_t i, n = mutf8len(s);
+
+	if (n == 1) {
+		*c = u[0] < 0x80 ? u[0] : 0xFFFD;
+	} else {
+		*c = u[0] & (0x7F >> n);
+		for (i = 1; i < n; ++i)
+			*c = (*c << 6) | (u[i] & 0x3F);
+	}
+	return n;
+}
+
+size_t mutf8enc(wint_t c, char *s) {
+	if (c < 0x80) {
+		s[0] = c;
+		return 1;
+	} else if (c < 0x800) {
+		s[0] = 0xC0 | (c >> 6);
+		s[1] = 0x80 | (c & 0x3F);
+		return 2;
+	} else if (c < 0x10000) {
+		s[0] = 0xE0 | (c >> 12);
+		s[1] = 0x80 | ((c >> 6) & 0x3F);
+		s[2] = 0x80 | (c & 0x3F);
+		return 3;
+	} else if (c < 0x110000) {
+		s[0] = 0xF0 | (c >> 18);
+		s[1] = 0x80 | ((c >> 12) & 0x3F);
+		s[2] = 0x80 | ((c >> 6) & 0x3F);
+		s[3] = 0x80 | (c & 0x3F);
+		return 4;
+	}
+	return mutf8enc(0xFFFD, s);
+}
+
+size_t mutf8tail(const char *s, size_t len) {
+	/* Number of bytes at the end of s that start an incomplete character */
+	size_t i;
+	for (i = 1; i <= 3 && i <= len; ++i) {
+		unsigned char c = s[len - i];
+		if ((c & 0xC0) == 0x80) continue;
+		if (c >= 0xC0 && (size_t)(c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4) > i) return i;
+		break;
+	}
+	return 0;
+}
+
+int mcount(const char *s, size_t len, bool *ascii) {
+	/* Count the characters in s and check if they are all ASCII, looking
+	 * at eight bytes at a time for the check */
+	uint64_t bits = 0, w;
+	size_t i;
+	int n = 0;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, s + i, 8);
+		bits |= w;
+	}
+	for (; i < len; ++i)
+		bits |= (unsigned char)s[i];
+
+	if ((*ascii = !(bits & 0x8080808080808080ULL))) return len;
+	for (i = 0; i < len; i += mutf8len(s + i))
+		n++;
+	return n;
+}
+
+void mscanln(struct Line *ln) {
+	/* Update the character count and ASCII flag from the line's bytes */
+	ln->nchars = mcount(ln->data, ln->len, &ln->ascii);
+	mtouch(ln, 0);
+}
+
+void mtouch(struct Line *ln, int idx) {
+	/* Forget the column checkpoints past the character idx, which changed */
+	int k = max(idx, 0) / COL_STEP + 1;
+	if (ln->cols && ln->cols->n > k) ln->cols->n = k;
+	ln->rowswrap = 0;
+}
+
+struct Cols* mcols(struct Buffer *buf, struct Line *ln, int k) {
+	/* Column checkpoints of a line, made up to the kth if they aren't */
+	struct Cols *c = ln->cols;
+
+	if (c && c->wrap != buf->wrap) c->n = 0;
+	if (!c || c->size <= k) {
+		struct Cols *old = c;
+		int size = max(k + 1, c ? 2 * c->size : 16);
+		c = realloc(c, sizeof(struct Cols) + size * sizeof(c->marks[0]));
+		assert(c);
+		if (!old) {
+			c->n = 0;
+			c->prev = NULL;
+			c->next = buf->pool.cols;
+		}
+		if (c->prev) c->prev->next = c;
+		else buf->pool.cols = c;
+		if (c->next) c->next->prev = c;
+		c->size = size;
+		ln->cols = c;
+	}
+	if (!c->n) {
+		c->marks[0].off = 0;
+		c->marks[0].col = 0;
+		c->n = 1;
+		c->wrap = buf->wrap;
+	}
+	for (; c->n <= k; c->n++) {
+		size_t off = c->marks[c->n - 1].off;
+		int col = c->marks[c->n - 1].col, i, w;
+		for (i = 0; i < COL_STEP && off < ln->len; ++i) {
+			w = mcolsof(ln, &off);
+			col = mplace(col, w, buf->wrap) + w;
+		}
+		c->marks[c->n].off = off;
+		c->marks[c->n].col = col;
+	}
+	return c;
+}
+
+void mfreecols(struct Buffer *buf, struct Line *ln) {
+	struct Cols *c = ln->cols;
+	if (!c) return;
+	if (c->prev) c->prev->next = c->next;
+	else buf->pool.cols = c->next;
+	if (c->next) c->next->prev = c->prev;
+	free(c);
+	ln->cols = NULL;
+}
+
+size_t moffset(struct Line *ln, int x) {
+	/* Byte offset of the xth character, walking from the last checkpoint
+	 * before it if there is one */
+	size_t off = 0;
+	if (x <= 0) return 0;
+	if (ln->ascii) return (size_t)x < ln->len ? (size_t)x : ln->len;
+	if (ln->cols && ln->cols->n > 1) {
+		int k = min(x / COL_STEP, ln->cols->n - 1);
+		off = ln->cols->marks[k].off;
+		x -= k * COL_STEP;
+	}
+	while (x-- && off < ln->len)
+		off += mutf8len(ln->data + off);
+	return off;
+}
+
+int mcharidx(struct Line *ln, size_t off) {
+	/* Number of characters before the byte offset off */
+	size_t i = 0;
+	int x = 0;
+	if (ln->ascii) return off;
+	if (ln->cols && ln->cols->n > 1) {
+		/* Start from the last checkpoint before off */
+		int lo = 0, hi = ln->cols->n - 1;
+		while (lo < hi) {
+			int mid = (lo + hi + 1) / 2;
+			if (ln->cols->marks[mid].off <= off) lo = mid;
+			else hi = mid - 1;
+		}
+		i = ln->cols->marks[lo].off;
+		x = lo * COL_STEP;
+	}
+	for (; i < off && i < ln->len; i += mutf8len(ln->data + i))
+		x++;
+	return x;
+}
+
+int mwidth(wchar_t c) {
+	/* Columns a character takes on screen. Tabs are tab_width wide and
+	 * control characters are shown as ^X. */
+	int w;
+	if (c == L'\t' || c == L'\n' || !c) return tab_width;
+	if (c < 0x80) return c < ' ' || c == 127 ? 2 : 1;
+	if ((w = wcwidth(c)) < 0) return c < 0x100 ? 2 : 1;
+	return w;
+}
+
+int mcolsof(struct Line *ln, size_t *off) {
+	/* Width of the character at *off, and move past it */
+	wchar_t c;
+	if (ln->ascii) c = ln->data[(*off)++];
+	else *off += mutf8dec(ln->data + *off, &c);
+	return mwidth(c);
+}
+
+int mplace(int pos, int w, int wrap) {
+	/* Screen position of a character w columns wide that comes at pos, the
+	 * start of the next row if it doesn't fit on this one */
+	if (wrap && w <= wrap && pos % wrap + w > wrap) return pos + wrap - pos % wrap;
+	return pos;
+}
+
+int mnumcols(struct Buffer *buf, struct Line *ln, int end) {
+	/* Screen position of the character end, counting the rows before it
+	 * when the line is wrapped. Long lines start from the last checkpoint
+	 * before it. */
+	int i = 0, ncols = 0, w;
+	size_t off = 0;
+
+	if (!ln) return 0;
+	end = min(end, ln->nchars);
+	if (ln->nchars >= 2 * COL_STEP) {
+		struct Cols *c = mcols(buf, ln, end / COL_STEP);
+		i = end / COL_STEP * COL_STEP;
+		off = c->marks[end / COL_STEP].off;
+		ncols = c->marks[end / COL_STEP].col;
+	}
+	for (; i < end && off < ln->len; ++i) {
+		w = mcolsof(ln, &off);
+		ncols = mplace(ncols, w, buf->wrap) + w;
+	}
+	if (buf->wrap && off < ln->len) ncols = mplace(ncols, mcolsof(ln, &off), buf->wrap);
+	return ncols;
+}
+
+int mcolidx(struct Buffer *buf, struct Line *ln, int pos) {
+	/* Index of the character at screen position pos, the number of
+	 * characters if the line ends before it */
+	int i = 0, col = 0, w;
+	size_t off = 0;
+
+	if (ln->nchars >= 2 * COL_STEP) {
+		/* Start from the last checkpoint at or before pos */
+		struct Cols *c = mcols(buf, ln, 0);
+		int lo = 0, hi;
+		while (c->marks[c->n - 1].col <= pos && c->n * COL_STEP <= ln->nchars)
+			c = mcols(buf, ln, c->n);
+		for (hi = c->n - 1; lo < hi; ) {
+			int mid = (lo + hi + 1) / 2;
+			if (c->marks[mid].col <= pos) lo = mid;
+			else hi = mid - 1;
+		}
+		i = lo * COL_STEP;
+		off = c->marks[lo].off;
+		col = c->marks[lo].col;
+	}
+	for (; i < ln->nchars && off < ln->len; ++i) {
+		w = mcolsof(ln, &off);
+		if ((col = mplace(col, w, buf->wrap) + w) > pos) break;
+	}
+	return i;
+}
+
+int mrows(struct Buffer *buf, struct Line *ln) {
+	/* Screen rows a line takes, counted once for every wrap width */
+	if (!buf->wrap || !ln) return 1;
+	if (ln->rowswrap != buf->wrap) {
+		ln->rows = mnumcols(buf, ln, ln->nchars) / buf->wrap + 1;
+		ln->rowswrap = buf->wrap;
+	}
+	return ln->rows;
+}
+
+int mrowsabove(struct Buffer *buf, int limit) {
+	/* Screen rows from the top of the view down to the cursor's, -1 if the
+	 * cursor is above the view. Counting stops once there are more than
+	 * limit, so it only looks at the lines in view. */
+	struct Line *ln = buf->curline;
+	int y = buf->cursor.c.y, n;
+
+	if (!ln) return 0;
+	n = buf->wrap ? mnumcols(buf, ln, buf->cursor.c.x) / buf->wrap : 0;
+	if (y < buf->starty || (y == buf->starty && n < buf->startrow)) return -1;
+	for (; y > max(buf->starty, 0) && n <= limit; --y) {
+		ln = mprev(buf, ln);
+		n += mrows(buf, ln);
+	}
+	if (y == buf->starty) n -= buf->startrow;
+	else if (!y) n -= buf->starty;
+	return n;
+}
+
+void mscroll(struct Buffer *buf) {
+	/* Scroll the view to the cursor, once there is a view */
+	int n;
+	if (viewrows <= 0) return;
+	if ((n = mrowsabove(buf, viewrows)) < 0) mscrollto(buf, 0);
+	else if (n >= viewrows) mscrollto(buf, viewrows - 1);
+}
+
+int mpage(struct Buffer *buf, int dir, int n) {
+	/* Number of lines to move by to go n screens up or down, a screen
+	 * being all rows of the view but one */
+	struct Line *ln = buf->curline;
+	long rows = (long)max(viewrows - 1, 1) * n;
+	int k = 0;
+
+	while (ln && rows > 0 && (ln = dir > 0 ? mnext(buf, ln) : mprev(buf, ln))) {
+		rows -= mrows(buf, ln);
+		k++;
+	}
+	return k;
+}
+
+void mscrollto(struct Buffer *buf, int n) {
+	/* Scroll so the cursor's row is n rows from the top of the view. Rows
+	 * above the first line are left empty if there aren't enough lines. */
+	struct Line *ln = buf->curline;
+	int y = buf->cursor.c.y, r;
+
+	if (!ln) return;
+	r = buf->wrap ? mnumcols(buf, ln, buf->cursor.c.x) / buf->wrap : 0;
+	while (n > r && y > 0) {
+		n -= r + 1;
+		ln = mprev(buf, ln);
+		y--;
+		r = mrows(buf, ln) - 1;
+	}
+	buf->starty = n > r ? y - n + r : y;
+	buf->startrow = n > r ? 0 : r - n;
+}
+
+void minsert(struct Buffer *buf, wint_t key) {
+	size_t idx, off;
+	struct Line *ln = buf->curline;
+
+	/* Create or resize the current line if needed. */
+	if (!ln) {
+		ln = buf->curline = mnewline(buf, 5);
+		mlinkln(buf, NULL, ln);
+	} else {
+		ln = buf->curline = mreserve(buf, ln, ln->len + 5);
+	}
+
+	idx = min(max(buf->cursor.c.x, 0), ln->nchars);
+	off = moffset(ln, idx);
+	mdirty(buf, buf->cursor.c.y, buf->cursor.c.y);
+	mtouch(ln, (int)idx - 1);
+
+	switch (key) {
+	case '\b':
+	case 127:
+	case KEY_BACKSPACE:
+		if (idx) {
+			size_t poff = moffset(ln, idx - 1);
+			mrecord(buf, false, buf->cursor.c.y, poff, ln->data + poff, off - poff);
+			memmove(ln->data + poff, ln->data + off, ln->len - off + 1);
+			ln->len -= off - poff;
+			ln->nchars--;
+			buf->cursor.c.x--;
+		} else if (ln->prev) {
+			struct Line *prev = mprev(buf, ln);
+			prev = mreserve(buf, prev, prev->len + ln->len + 1);
+			int plen = prev->nchars;
+			mrecord(buf, false, buf->cursor.c.y - 1, prev->len, "\n", 1);
+			mdirty(buf, buf->cursor.c.y - 1, buf->cursor.c.y - 1);
+			mtouch(prev, plen);
+			memcpy(prev->data + prev->len, ln->data, ln->len + 1);
+			prev->len += ln->len;
+			prev->nchars += ln->nchars;
+			prev->ascii = prev->ascii && ln->ascii;
+			mmove(buf, plen + buf->cursor.c.x, -1);
+			buf->curline = prev;
+			mfreeln(buf, ln);
+		}
+		break;
+	case KEY_DC:
+		if (idx < (size_t)ln->nchars) {
+			size_t n = mutf8len(ln->data + off);
+			mrecord(buf, false, buf->cursor.c.y, off, ln->data + off, n);
+			memmove(ln->data + off, ln->data + off + n, ln->len - off - n + 1);
+			ln->len -= n;
+			ln->nchars--;
+		}
+		break;
+	case '\n':
+		{
+			int ox = 0;
+			size_t x, mx = 0;
+			struct Line *old = ln;
+
+			if (auto_indent) {
+				/* Indent to the last position */
+				for (x = 0; x < off; ++x) {
+					if (old->data[x] == '\t') mx += tab_width;
+					else if (isspace((unsigned char)old->data[x])) mx++;
+					else break;
+				}
+			}
+
+			/* The indentation never takes more bytes than columns */
+			ln = mnewline(buf, mx + old->len - off + 1);
+			mlinkln(buf, old, ln);
+			ox = mindent(ln, mx);
+
+			memcpy(ln->data + ox, old->data + off, old->len - off + 1);
+			ln->len = ox + old->len - off;
+			ln->nchars = ox + old->nchars - idx;
+			ln->ascii = old->ascii;
+			old->data[off] = 0;
+			old->len = off;
+			old->nchars = idx;
+			if (!old->ascii) {
+				mscanln(old);
+				mscanln(ln);
+			}
+			mrecord(buf, true, buf->cursor.c.y, off, "\n", 1);
+			mrecord(buf, true, buf->cursor.c.y + 1, 0, ln->data, ox);
+			mjump(buf, MARKER_START);
+			mmove(buf, ox, +1);
+		}
+		break;
+	default:
+		{
+			char c[4];
+			size_t n = mutf8enc(key, c);
+			memmove(ln->data + off + n, ln->data + off, ln->len - off + 1);
+			memcpy(ln->data + off, c, n);
+			ln->len += n;
+			ln->nchars++;
+			if (n > 1) ln->ascii = false;
+			buf->cursor.c.x++;
+			mrecord(buf, true, buf->cursor.c.y, off, c, n);
+		}
+		break;
+	}
+}
+
+void minsertstr(struct Buffer *buf, const char *s, size_t len) {
+	/* Insert text at the cursor, allocating new lines at their final size */
+	struct Line *ln = buf->curline;
+	const char *nl, *end = s + len;
+	size_t idx, off, n;
+	struct Line *first, *head;
+	char *tail = NULL;
+	size_t taillen = 0;
+	int count = 0;
+	bool ascii;
+
+	if (!ln) {
+		ln = buf->curline = mnewline(buf, len + 1);
+		mlinkln(buf, NULL, ln);
+	}
+	if (!(nl = memchr(s, '\n', len))) nl = end;
+	n = nl - s;
+	ln = buf->curline = mreserve(buf, ln, ln->len + n + 1);
+	idx = min(max(buf->cursor.c.x, 0), ln->nchars);
+	off = moffset(ln, idx);
+	mdirty(buf, buf->cursor.c.y, buf->cursor.c.y);
+	mtouch(ln, idx);
+	mrecord(buf, true, buf->cursor.c.y, off, s, len);
+
+	/* Text after the cursor moves to the end of the last inserted line */
+	if (nl < end) {
+		taillen = ln->len - off;
+		tail = malloc(taillen + 1);
+		assert(tail);
+		memcpy(tail, ln->data + off, taillen + 1);
+		ln->data[off] = 0;
+		ln->len = off;
+		ln->nchars = idx;
+	}
+
+	/* First piece goes into the current line */
+	memmove(ln->data + off + n, ln->data + off, ln->len - off + 1);
+	memcpy(ln->data + off, s, n);
+	ln->len += n;
+	buf->cursor.c.x = idx + mcount(s, n, &ascii);
+	ln->nchars += buf->cursor.c.x - idx;
+	ln->ascii = ln->ascii && ascii;
+
+	/* Every other piece becomes a new line, they are linked in at once */
+	first = ln;
+	head = NULL;
+	while (nl < end) {
+		struct Line *prev = ln;
+		s = nl + 1;
+		if (!(nl = memchr(s, '\n', end - s))) nl = end;
+		n = nl - s;
+
+		ln = mnewline(buf, n + (nl == end ? taillen : 0) + 1);
+		memcpy(ln->data, s, n);
+		ln->len = n;
+		buf->cursor.c.x = mcount(s, n, &ascii);
+		if (nl == end) {
+			memcpy(ln->data + n, tail, taillen + 1);
+			ln->len += taillen;
+		}
+		mscanln(ln);
+		ln->prev = prev == first ? NULL : prev;
+		ln->next = NULL;
+		if (ln->prev) prev->next = ln;
+		else head = ln;
+		count++;
+	}
+	if (head) mlinklines(buf, first, head, ln, count);
+
+	if (tail) {
+		buf->curline = ln;
+		buf->cursor.c.y = mlineno(ln);
+		free(tail);
+	}
+}
+
+int mindent(struct Line *ln, int n) {
+	int i, j, tabs, spaces;
+
+	tabs = n / tab_width;
+	spaces = n % tab_width;
+
+	for (i = 0; i < tabs; ++i)
+		ln->data[i] = '\t';
+	for (j = 0; j < spaces; ++j)
+		ln->data[i+j] = ' ';
+
+	return tabs + spaces;
+}
+
+void mmove(struct Buffer *buf, int x, int y) {
+	int len;
+
+	if (!buf->curline) return;
+
+	/* left / right */
+	buf->cursor.c.x += x;
+
+	/* up / down */
+	if (y) {
+		long n = (long)mlineno(buf->curline) + y;
+		if (n >= buf->numlines) n = buf->numlines - 1;
+		if (n < 0) n = 0;
+		buf->curline = mgetline(buf, n);
+		buf->cursor.c.y = n;
+	}
+
+	/* Restrict cursor to line content */
+	len = buf->curline->nchars;
+	buf->cursor.c.x = max(min(buf->cursor.c.x, len), 0);
+	mscroll(buf);
+
+	/* Update selection end */
+	if (mode == MODE_SELECT) {
+		mselect(buf, buf->cursor.v0.x, buf->cursor.v0.y, buf->cursor.c.x, buf->cursor.c.y);
+	}
+}
+
+void mjump(struct Buffer *buf, enum Marker mark) {
+	switch(mark) {
+	case MARKER_START:
+		buf->cursor.c.x = 0;
+		break;
+	case MARKER_MIDDLE:
+		{
+			struct Line *ln = buf->curline;
+			if (!ln) return;
+			buf->cursor.c.x = ln->nchars / 2;
+		}
+		break;
+	case MARKER_END:
+		{
+			struct Line *ln = buf->curline;
+			if (!ln) return;
+			buf->cursor.c.x = ln->nchars;
+		}
+		break;
+	}
+}
+
+void mselect(struct Buffer *buf, int x1, int y1, int x2, int y2) {
+	/* Repaint the lines of both the old and the new selection */
+	mdirty(buf, min(buf->cursor.v0.y, buf->cursor.v1.y), max(buf->cursor.v0.y, buf->cursor.v1.y));
+	mdirty(buf, min(y1, y2), max(y1, y2));
+	buf->cursor.v0 = (struct Coord){ x1, y1 };
+	buf->cursor.v1 = (struct Coord){ x2, y2 };
+}
+
+void mdirty(struct Buffer *buf, int from, int to) {
+	if (buf->dirty0 > buf->dirty1) {
+		buf->dirty0 = from;
+		buf->dirty1 = to;
+	} else {
+		buf->dirty0 = min(buf->dirty0, from);
+		buf->dirty1 = max(buf->dirty1, to);
+	}
+}
+
+void mfeedstart(struct Buffer *buf, int fd) {
+	/* Append whatever arrives on fd to buf from now on */
+	struct Feed *f = calloc(1, sizeof(struct Feed));
+	assert(f);
+	f->fd = fd;
+	f->buf = buf;
+	f->next = feeds;
+	feeds = f;
+}
+
+bool mfeedread() {
+	/* Append at most job_read_budget bytes from each pipe without waiting
+	 * for more, returns true if there was any */
+	struct Feed *f, *next;
+	char *blk = malloc(file_block_size + sizeof(f->part));
+	bool any = false;
+
+	assert(blk);
+	for (f = feeds; f; f = next) {
+		struct pollfd pfd = { f->fd, POLLIN, 0 };
+		size_t total = 0, keep;
+		bool eof = false;
+		ssize_t n;
+
+		next = f->next;
+		while (total < job_read_budget && poll(&pfd, 1, 0) > 0) {
+			memcpy(blk, f->part, f->npart);
+			if ((n = read(f->fd, blk + f->npart, file_block_size)) < 0 && (errno == EAGAIN || errno == EINTR))
+				break;
+			if (n <= 0) {
+				eof = true;
+				break;
+			}
+			total += n;
+			n += f->npart;
+			keep = mutf8tail(blk, n);
+			mappend(f->buf, blk, n - keep);
+			memcpy(f->part, blk + n - keep, keep);
+			f->npart = keep;
+		}
+
+		f->total += total;
+		any = any || total;
+		if (eof) {
+			mappend(f->buf, f->part, f->npart);
+			mfeedstop(f);
+		}
+	}
+	free(blk);
+	return any;
+}
+
+void mfeedstop(struct Feed *f) {
+	struct Feed **p = &feeds;
+	while (*p != f) p = &(*p)->next;
+	*p = f->next;
+	close(f->fd);
+	free(f);
+}
+
+void mappend(struct Buffer *buf, const char *s, size_t len) {
+	/* Add text at the end of the buffer, leaving the user's cursor alone */
+	struct Cursor cursor = buf->cursor;
+	unsigned changes = buf->changes;
+	int numlines = buf->numlines;
+
+	if (!len) return;
+	buf->curline = mgetline(buf, numlines - 1);
+	buf->cursor.c.y = max(0, numlines - 1);
+	buf->cursor.c.x = buf->curline ? buf->curline->nchars : 0;
+	undoing = true; /* Loaded text is not an edit */
+	minsertstr(buf, s, len);
+	undoing = false;
+	buf->changes = changes;
+
+	buf->cursor = cursor;
+	buf->curline = mgetline(buf, max(0, min(cursor.c.y, buf->numlines - 1)));
+
+	/* A search wraps around at the end, it has to start over if it did */
+	if (search.src && search.buf == buf && search.from.c.y + search.pos > numlines)
+		msearchrestart();
+}
+
+bool mcompile(const char *src) {
+	/* Compile src unless it is the pattern used last time */
+	regex_t reg;
+
+	if (pattern.src && !strcmp(pattern.src, src)) return true;
+	if (regcomp(&reg, src, 0)) return false;
+
+	if (pattern.src) {
+		regfree(&pattern.reg);
+		free(pattern.src);
+	}
+	pattern.src = strdup(src);
+	assert(pattern.src);
+	pattern.reg = reg;
+	mliteral(src);
+	return true;
+}
+
+bool mmemmem(const char *s, size_t len) {
+	/* Check if s contains the pattern's literal. memchr() skips ahead to
+	 * candidates much faster than a general substring search on short lines. */
+	const char *end = s + len, *p = s;
+	size_t n = pattern.litlen;
+
+	while ((size_t)(end - p) >= n && (p = memchr(p, pattern.lit[0], end - p - n + 1))) {
+		if (!memcmp(p + 1, pattern.lit + 1, n - 1)) return true;
+		p++;
+	}
+	return false;
+}
+
+bool mmatch(const char *s, size_t len, size_t off, regmatch_t *m) {
+	/* Match the pattern against the text s from byte off on. Lines without
+	 * its literal part can't match. */
+	if (pattern.litlen && !mmemmem(s + off, len - off)) return false;
+	m->rm_so = off;
+	m->rm_eo = len;
+	return !regexec(&pattern.reg, s, 1, m, REG_STARTEND);
+}
+
+void mliteral(const char *src) {
+	/* Find the longest run of plain characters that has to appear in every
+	 * match of the basic regular expression src. Anything we don't fully
+	 * understand just ends the current run. */
+	char run[sizeof(pattern.lit)];
+	const char *p = src;
+	size_t n, len = 0;
+	int depth = 0;
+
+	pattern.litlen = 0;
+	for (;;) {
+		bool plain = false;
+		n = 1;
+
+		if (p[0] == '\\' && p[1]) {
+			n = 2;
+			if (p[1] == '(') depth++;
+			else if (p[1] == ')') depth--;
+			else if (p[1] == '|') break; /* Alternation, nothing is required */
+			else if (p[1] == '{') {
+				/* Skip the interval */
+				while (p[n] && !(p[n-1] == '\\' && p[n] == '}')) n++;
+				if (p[n]) n++;
+			}
+			else plain = strchr(".*[]^$\\/", p[1]) != NULL;
+		} else if (*p == '[') {
+			/* Skip the bracket expression, including [:classes:] */
+			if (p[n] == '^') n++;
+			if (p[n] == ']') n++;
+			while (p[n] && p[n] != ']') {
+				if (p[n] == '[' && p[n+1] && strchr(":.=", p[n+1])) {
+					const char *e = strchr(p + n + 2, ']');
+					n = e ? (size_t)(e - p) + 1 : n + 1;
+				} else n++;
+			}
+			if (p[n]) n++;
+		} else if (*p) {
+			n = mutf8len(p);
+			plain = !strchr(".*[^$", *p);
+		}
+
+		/* A quantifier makes the preceding character optional */
+		if (plain && (p[n] == '*' || (p[n] == '\\' && p[n+1] && strchr("?+{", p[n+1]))))
+			plain = false;
+
+		if (plain && !depth && len + n < sizeof(run)) {
+			/* Escaped characters are copied without the backslash */
+			if (*p == '\\') run[len++] = p[1];
+			else {
+				memcpy(run + len, p, n);
+				len += n;
+			}
+		} else {
+			if (len > pattern.litlen) {
+				memcpy(pattern.lit, run, len);
+				pattern.litlen = len;
+			}
+			len = 0;
+		}
+		if (!*p) return;
+		p += n;
+	}
+	pattern.litlen = 0;
+}
+
+void mshowmatch(struct Buffer *buf, int y, size_t so, size_t eo) {
+	/* Jump to the match from byte so to eo on line y, select it */
+	int x, len;
+	mmove(buf, 0, y - buf->cursor.c.y);
+	x = mcharidx(buf->curline, so);
+	len = mcharidx(buf->curline, eo) - x;
+	buf->cursor.c.x = x;
+	mselect(buf, x, y, x + len - 1, y);
+}
+
+void msearchhit(int i) {
+	/* Record the index of a matching line */
+	if (search.nhits == search.nhitsize) {
+		search.nhitsize = search.nhitsize * 2 + 64;
+		search.hits = realloc(search.hits, search.nhitsize * sizeof(int));
+		assert(search.hits);
+	}
+	search.hits[search.nhits++] = i;
+}
+
+void msearchback() {
+	/* Put the cursor back where the search started */
+	struct Cursor *c = &search.from;
+	mmove(search.buf, 0, c->c.y - search.buf->cursor.c.y);
+	search.buf->cursor.c.x = c->c.x;
+	mselect(search.buf, c->v0.x, c->v0.y, c->v1.x, c->v1.y);
+}
+
+void msearchrestart() {
+	/* Scan the whole buffer again, starting at the line of the cursor */
+	struct Buffer *buf = search.buf;
+	search.ncand = search.icand = search.nhits = 0;
+	search.pos = 0;
+	search.from.c.y = max(0, min(search.from.c.y, buf->numlines - 1));
+	miterat(buf, &search.it, search.from.c.y);
+}
+
+bool msearchstep() {
+	/* Scan for matches until the time slice is used up, returns true if
+	 * there is more to do */
+	struct Buffer *buf = search.buf;
+	struct timespec t0, t;
+	int i, n = 0;
+
+	if (!search.src || !search.valid || !search.it.ln) return false;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	while (search.icand < search.ncand || search.pos <= buf->numlines) {
+		struct Iter cand, *it = &search.it;
+		regmatch_t match;
+		size_t off;
+
+		/* Check the previous matches first, they come before the scan position */
+		if (search.icand < search.ncand) {
+			i = search.cand[search.icand++];
+			miterat(buf, &cand, (search.from.c.y + i) % buf->numlines);
+			it = &cand;
+		} else {
+			i = search.pos++;
+		}
+
+		off = i ? 0 : moffset(mgetline(buf, it->y), search.from.c.x + 1);
+		if (mmatch(it->p, it->len, off, &match)) {
+			msearchhit(i);
+			if (!search.found) {
+				search.found = true;
+				mshowmatch(buf, it->y, match.rm_so, match.rm_eo);
+			}
+		}
+		if (it == &search.it) miternext(buf, it);
+
+		if (++n % 256 == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &t);
+			if ((t.tv_sec - t0.tv_sec) * 1000 + (t.tv_nsec - t0.tv_nsec) / 1000000 >= search_slice_time)
+				return true;
+		}
+	}
+	return false;
+}
+
+void msearchend() {
+	/* Stop searching and go back to where we started */
+	if (!search.src) return;
+
+	msearchback();
+	mdirty(search.buf, 0, INT_MAX);
+
+	free(search.src);
+	free(search.hits);
+	free(search.cand);
+	memset(&search, 0, sizeof(search));
+}
+
+bool msave(struct Buffer *buf, const char *path) {
+	/* Write the buffer to path, or to its own file if that is NULL */
+	char *real, *tmp, *blk;
+	struct Region *r;
+	struct stat st;
+	struct Line *ln;
+	size_t n = 0;
+	bool own, exists, denied, mapped = false, inplace = false, ok = true;
+	int fd, err = 0;
+	mode_t mask;
+
+	if (!path) path = buf->path;
+	if (!path) return false;
+	own = buf->path && !strcmp(path, buf->path);
+
+	/* Write through symbolic links */
+	if ((real = realpath(path, NULL))) path = real;
+	exists = !stat(path, &st);
+
+	/* A file we may not write is not replaced behind its owner's back, and
+	 * one with other names keeps them, so both are overwritten where they
+	 * are. That can't be done while the buffer still reads its text from it. */
+	for (r = buf->regions; r; r = r->next) mapped = mapped || r->marks;
+	denied = exists && access(path, W_OK);
+	inplace = denied || (exists && st.st_nlink > 1);
+	if (inplace && own && mapped) {
+		free(real);
+		errno = denied ? EACCES : EBUSY;
+		return false;
+	}
+
+	/* The old file survives the rename below, so a hard link is a free
+	 * backup. The backup can't share a file that is overwritten. */
+	if (backup_on_write && exists) {
+		unlink(backup_path);
+		if (inplace || link(path, backup_path)) mcopyfile(path, backup_path);
+	}
+
+	/* Write to a temporary file next to the target and rename it over */
+	tmp = malloc(strlen(path) + 8);
+	blk = malloc(file_block_size);
+	assert(tmp && blk);
+	sprintf(tmp, "%s.XXXXXX", path);
+
+	/* Without a writable directory the file is overwritten where it is too */
+	if (!inplace && (fd = mkstemp(tmp)) < 0 && exists && !(own && mapped)) {
+		if (backup_on_write) {
+			unlink(backup_path);
+			mcopyfile(path, backup_path);
+		}
+		inplace = true;
+	}
+	if (inplace) fd = open(path, O_WRONLY | O_TRUNC);
+
+	if (fd < 0) {
+		ok = false;
+		err = errno;
+	} else {
+		/* The file keeps its owner (where allowed) and mode, new files
+		 * get the mode they would have been created with */
+		if (!inplace && exists) {
+			fchown(fd, st.st_uid, st.st_gid);
+			fchmod(fd, st.st_mode & 07777);
+		} else if (!inplace) {
+			umask(mask = umask(0));
+			fchmod(fd, 0666 & ~mask);
+		}
+
+		/* Spans are written straight from the mapped file */
+		for (ln = mfirstline(buf); ln && ok; ln = ln->next) {
+			ok = mwriteblk(fd, blk, &n, ln->data, ln->len);
+			if (ok && ln->next) ok = mwriteblk(fd, blk, &n, "\n", 1);
+		}
+		ok = ok && mwrite(fd, blk, n) && !fsync(fd);
+		ok = !close(fd) && ok && (inplace || !rename(tmp, path));
+		if (!ok) err = errno;
+		if (!ok && !inplace) unlink(tmp);
+	}
+
+	/* The journal starts over with the saved file */
+	if (ok && own) {
+		mswapsaved(buf, path);
+		buf->changes = 0;
+	}
+
+	free(blk);
+	free(tmp);
+	free(real);
+	errno = err;
+	return ok;
+}
+
+bool mwrite(int fd, const char *data, size_t len) {
+	while (len) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool mwriteblk(int fd, char *blk, size_t *n, const char *data, size_t len) {
+	/* Append data to the output block, writing it out when it is full */
+	if (*n + len > file_block_size) {
+		if (!mwrite(fd, blk, *n)) return false;
+		*n = 0;
+		if (len > file_block_size) return mwrite(fd, data, len);
+	}
+	memcpy(blk + *n, data, len);
+	*n += len;
+	return true;
+}
+
+void mcopyfile(const char *src, const char *dst) {
+	int in, out;
+	ssize_t n = -1;
+
+	if ((in = open(src, O_RDONLY)) < 0) return;
+	if ((out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0600)) >= 0) {
+#ifdef __linux__
+		/* Let the kernel copy (or reflink) the data */
+		while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0);
+#endif
+		if (n < 0) {
+			/* Fall back to copying in blocks from where it stopped */
+			char *blk = malloc(file_block_size);
+			assert(blk);
+			while ((n = read(in, blk, file_block_size)) > 0 && mwrite(out, blk, n));
+			free(blk);
+		}
+		close(out);
+	}
+	close(in);
+}
+
+void mswapopen(struct Buffer *buf, const char *path) {
+	/* Edits are journaled next to the file as .name.mett-swp. A journal left
+	 * behind for this very version of the file is kept for mrecover, one for
+	 * an older version is of no use, and anything else isn't ours to touch. */
+	const char *base = strrchr(path, '/');
+	struct SwapFile *sw;
+	struct stat st;
+	char head[64], old[64], msg[256];
+	int fd, len, n = 0;
+	bool mine = true;
+
+	if (!swap_files) return;
+	sw = calloc(1, sizeof(struct SwapFile));
+	base = base ? base + 1 : path;
+	sw->path = malloc(strlen(path) + 11);
+	assert(sw && sw->path);
+	sprintf(sw->path, "%.*s.%s.mett-swp", (int)(base - path), path, base);
+	sw->fd = -1;
+	if (!stat(path, &st)) {
+		sw->fsize = st.st_size;
+		sw->fmtime = st.st_mtim;
+	}
+
+	if ((fd = open(sw->path, O_RDONLY | O_NOFOLLOW)) >= 0 || errno != ENOENT) {
+		len = snprintf(head, sizeof(head), "mett swap %lld %lld.%09ld\n",
+			(long long)sw->fsize, (long long)sw->fmtime.tv_sec, sw->fmtime.tv_nsec);
+		mine = fd >= 0 && !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_uid == geteuid()
+			&& (n = read(fd, old, sizeof(old))) >= 10 && !memcmp(old, "mett swap ", 10);
+		if (mine && n > len && !memcmp(old, head, len)) {
+			sw->stale = true;
+			snprintf(msg, sizeof(msg), "%s: left by a crash, see :recover\n", sw->path);
+		} else if (mine) {
+			unlink(sw->path);
+		} else {
+			snprintf(msg, sizeof(msg), "%s: exists, edits are not journaled\n", sw->path);
+		}
+		if ((sw->stale || !mine) && cmdbuf) mreadstr(cmdbuf, msg);
+		if (fd >= 0) close(fd);
+	}
+	if (!mine) {
+		free(sw->path);
+		free(sw);
+		return;
+	}
+	buf->swap = sw;
+
+	pthread_mutex_lock(&swaps.lock);
+	sw->next = swaps.list;
+	swaps.list = sw;
+	if (!swaps.started)
+		swaps.started = !pthread_create(&swaps.thread, NULL, mswapthread, NULL);
+	pthread_mutex_unlock(&swaps.lock);
+}
+
+bool mswapcreate(struct Buffer *buf) {
+	/* Swap files are only made once there are edits to keep */
+	struct SwapFile *sw = buf->swap;
+	char head[64];
+	int fd, len;
+
+	len = snprintf(head, sizeof(head), "mett swap %lld %lld.%09ld\n",
+		(long long)sw->fsize, (long long)sw->fmtime.tv_sec, sw->fmtime.tv_nsec);
+	fd = open(sw->path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0600);
+	if (fd >= 0 && !mwrite(fd, head, len)) {
+		close(fd);
+		unlink(sw->path);
+		fd = -1;
+	}
+	if (fd < 0) {
+		/* Without a place to put it, the buffer goes without a journal */
+		mswapclose(buf);
+		return false;
+	}
+
+	pthread_mutex_lock(&swaps.lock);
+	sw->fd = fd;
+	pthread_mutex_unlock(&swaps.lock);
+	return true;
+}
+
+int mswapreplay(struct Buffer *buf, const char *p, size_t len) {
+	/* Make the edits of a swap file again, up to the first one that is
+	 * incomplete. Returns the number of edits. */
+	const char *end = p + len;
+	size_t y, off, n;
+	int count = 0;
+
+	undoing = true;
+	while (p < end) {
+		char op = *p++;
+		if (!mgetnum(&p, end, &y) || !mgetnum(&p, end, &off) || !mgetnum(&p, end, &n)) break;
+		if (op == 'i' && (size_t)(end - p) >= n) {
+			mgoto(buf, y, off);
+			minsertstr(buf, p, n);
+			p += n;
+		} else if (op == 'd') {
+			mdelete(buf, y, off, n);
+		} else break;
+		count++;
+	}
+	undoing = false;
+	return count;
+}
+
+void mswaprec(struct Buffer *buf, bool insert, int y, size_t off, const char *s, size_t len) {
+	/* Queue an edit for the flush thread */
+	struct SwapFile *sw = buf->swap;
+	size_t need = 1 + 3 * 10 + (insert ? len : 0);
+	char *p;
+
+	if (sw->stale || (sw->fd < 0 && !mswapcreate(buf))) return;
+	pthread_mutex_lock(&swaps.lock);
+	if (sw->len + need > sw->size) {
+		sw->size = max(sw->size * 2, sw->len + need);
+		sw->data = realloc(sw->data, sw->size);
+		assert(sw->data);
+	}
+	p = sw->data + sw->len;
+	*p++ = insert ? 'i' : 'd';
+	p += mputnum(p, y);
+	p += mputnum(p, off);
+	p += mputnum(p, len);
+	if (insert) {
+		memcpy(p, s, len);
+		p += len;
+	}
+	sw->len = p - sw->data;
+	pthread_mutex_unlock(&swaps.lock);
+}
+
+int mrecover(struct Buffer *buf) {
+	/* Replay the journal a crashed session left behind, which is the
+	 * buffer's journal from then on. Returns the number of edits, -1 if
+	 * there is no journal to recover or the buffer was changed since. */
+	struct SwapFile *sw = buf->swap;
+	struct stat st;
+	char *data = NULL;
+	size_t n = 0, len;
+	ssize_t r = 0;
+	int fd, count = -1;
+
+	if (!sw || !sw->stale || buf->changes) return -1;
+	if ((fd = open(sw->path, O_RDWR | O_APPEND)) < 0) return -1;
+	if (!fstat(fd, &st) && (data = malloc(st.st_size + 1)))
+		while (n < (size_t)st.st_size && (r = read(fd, data + n, st.st_size - n)) > 0) n += r;
+
+	/* The header was checked when the file was opened */
+	if (data && (len = strcspn(data, "\n") + 1) < n) {
+		buf->swap = NULL;
+		count = mswapreplay(buf, data + len, n - len);
+		buf->swap = sw;
+		sw->stale = false;
+		sw->fd = fd;
+	} else {
+		close(fd);
+	}
+	free(data);
+	return count;
+}
+
+void mswapsaved(struct Buffer *buf, const char *path) {
+	/* The edits so far are in the file now */
+	struct SwapFile *sw = buf->swap;
+	struct stat st;
+
+	if (!sw) return;
+	pthread_mutex_lock(&swaps.lock);
+	while (sw->busy) pthread_cond_wait(&swaps.idle, &swaps.lock);
+	sw->len = 0;
+	if (sw->fd >= 0) {
+		close(sw->fd);
+		unlink(sw->path);
+		sw->fd = -1;
+	}
+
+	/* A crashed session's journal doesn't fit the saved file any more */
+	if (sw->stale) unlink(sw->path);
+	sw->stale = false;
+	if (!stat(path, &st)) {
+		sw->fsize = st.st_size;
+		sw->fmtime = st.st_mtim;
+	}
+	pthread_mutex_unlock(&swaps.lock);
+}
+
+void mswapclose(struct Buffer *buf) {
+	/* Remove the swap file, or sync what is left of it if we are dying */
+	struct SwapFile **p, *sw = buf->swap;
+
+	if (!sw) return;
+	buf->swap = NULL;
+
+	pthread_mutex_lock(&swaps.lock);
+	while (sw->busy) pthread_cond_wait(&swaps.idle, &swaps.lock);
+	for (p = &swaps.list; *p && *p != sw; p = &(*p)->next);
+	if (*p) *p = sw->next;
+	pthread_mutex_unlock(&swaps.lock);
+
+	if (sw->fd >= 0) {
+		if (dying && mwrite(sw->fd, sw->data, sw->len)) fdatasync(sw->fd);
+		close(sw->fd);
+		if (!dying) unlink(sw->path);
+	}
+	free(sw->data);
+	free(sw->path);
+	free(sw);
+}
+
+void* mswapthread(void *arg) {
+	/* Write queued records out and sync them every swap_sync_interval ms,
+	 * so the editor never waits for the disk */
+	struct timespec t = { swap_sync_interval / 1000, swap_sync_interval % 1000 * 1000000L };
+	struct SwapFile *sw;
+	sigset_t set;
+
+	(void)arg;
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	for (;;) {
+		nanosleep(&t, NULL);
+		pthread_mutex_lock(&swaps.lock);
+		for (sw = swaps.list; sw; sw = sw->next) {
+			char *data = sw->data;
+			size_t len = sw->len;
+			if (sw->fd < 0 || !len) continue;
+
+			/* The records are ours now, new ones go into a new block */
+			sw->data = NULL;
+			sw->len = sw->size = 0;
+			sw->busy = true;
+			pthread_mutex_unlock(&swaps.lock);
+			if (mwrite(sw->fd, data, len)) fdatasync(sw->fd);
+			free(data);
+			pthread_mutex_lock(&swaps.lock);
+			sw->busy = false;
+			pthread_cond_broadcast(&swaps.idle);
+		}
+		pthread_mutex_unlock(&swaps.lock);
+	}
+	return NULL;
+}
+
+size_t mputnum(char *p, size_t n) {
+	/* Store a number 7 bits at a time, the last byte has the top bit clear */
+	size_t i = 0;
+	for (; n >= 0x80; n >>= 7)
+		p[i++] = (char)((n & 0x7F) | 0x80);
+	p[i++] = (char)n;
+	return i;
+}
+
+bool mgetnum(const char **p, const char *end, size_t *n) {
+	int shift = 0;
+	*n = 0;
+	while (*p < end && shift < 64) {
+		unsigned char c = *(*p)++;
+		*n |= (size_t)(c & 0x7F) << shift;
+		if (!(c & 0x80)) return true;
+		shift += 7;
+	}
+	return false;
+}
+
+void mrecord(struct Buffer *buf, bool insert, int y, size_t off, const char *s, size_t len) {
+	/* Add an edit to the buffer's journal, merging it into the last one
+	 * where possible. Edits that are undone are forgotten now. */
+	struct Journal *j = &buf->journal;
+	struct Edit *e = j->last;
+	struct Chunk *c;
+	int ey = y;
+	size_t i, eoff = off, size;
+
+	if (buf->swap && len) mswaprec(buf, insert, y, off, s, len);
+	if (len) buf->changes++;
+	if (undoing || buf == cmdbuf || !len) return;
+
+	for (i = 0; i < len; ++i) {
+		if (s[i] == '\n') {
+			ey++;
+			eoff = 0;
+		} else eoff++;
+	}
+
+	/* Throw away the edits that could have been redone */
+	while ((c = j->tail) && !(e && (char*)e >= c->data && (char*)e < c->data + c->len)) {
+		j->tail = c->prev;
+		j->size -= c->size;
+		free(c);
+	}
+	if (c) {
+		c->next = NULL;
+		c->len = (char*)e - c->data + ((sizeof(struct Edit) + e->len + 7) & ~7);
+		e->next = NULL;
+	} else {
+		j->head = NULL;
+	}
+
+	/* Edits of the same command, and text typed key after key, extend
+	 * the last edit */
+	if (e && e->insert == insert && (e->seq == editseq || (mode == MODE_INSERT && e->seq + 1 == editseq))) {
+		size = (char*)e - c->data + ((sizeof(struct Edit) + e->len + len + 7) & ~7);
+		if (size <= c->size) {
+			if (insert && y == e->ey && off == e->eoff) {
+				memcpy(e->text + e->len, s, len);
+				e->ey = ey;
+				e->eoff = y == ey ? e->eoff + len : eoff;
+			} else if (!insert && y == e->y && off == e->off) {
+				memcpy(e->text + e->len, s, len);
+			} else if (!insert && ey == e->y && eoff == e->off && e->len < 4096) {
+				/* Backspace, the new text goes in front */
+				memmove(e->text + len, e->text, e->len);
+				memcpy(e->text, s, len);
+				e->y = y;
+				e->off = off;
+			} else size = 0;
+
+			if (size) {
+				e->len += len;
+				e->seq = editseq;
+				c->len = size;
+				return;
+			}
+		}
+	}
+
+	/* Nothing is kept if the edit alone is larger than the limit */
+	size = (sizeof(struct Edit) + len + 7) & ~7;
+	if (size > undo_limit) {
+		mforget(buf);
+		return;
+	}
+
+	if (!c || c->len + size > c->size) {
+		size_t n = size > undo_block_size ? size : undo_block_size;
+		c = malloc(sizeof(struct Chunk) + n);
+		assert(c);
+		c->len = 0;
+		c->size = n;
+		c->next = NULL;
+		c->prev = j->tail;
+		if (j->tail) j->tail->next = c;
+		else j->head = c;
+		j->tail = c;
+		j->size += n;
+	}
+
+	e = (struct Edit*)(c->data + c->len);
+	c->len += size;
+	e->prev = j->last;
+	e->next = NULL;
+	if (j->last) j->last->next = e;
+	j->last = e;
+	e->seq = editseq;
+	e->insert = insert;
+	e->y = y;
+	e->off = off;
+	e->ey = ey;
+	e->eoff = y == ey ? off + len : eoff;
+	e->len = len;
+	memcpy(e->text, s, len);
+
+	/* Drop the oldest edits to stay below the limit */
+	while (j->size > undo_limit && j->head != j->tail) {
+		c = j->head;
+		j->head = c->next;
+		j->head->prev = NULL;
+		j->size -= c->size;
+		free(c);
+		((struct Edit*)j->head->data)->prev = NULL;
+	}
+}
+
+void mforget(struct Buffer *buf) {
+	/* Free the journal, nothing can be undone afterwards */
+	struct Chunk *c = buf->journal.head;
+	while (c) {
+		struct Chunk *next = c->next;
+		free(c);
+		c = next;
+	}
+	memset(&buf->journal, 0, sizeof(buf->journal));
+}
+
+void mundo(struct Buffer *buf, bool redo) {
+	/* Undo or redo the edits of one command */
+	struct Journal *j = &buf->journal;
+	struct Edit *e;
+	unsigned seq;
+
+	if (redo) e = j->last ? j->last->next : j->head && j->head->len ? (struct Edit*)j->head->data : NULL;
+	else e = j->last;
+	if (!e) return;
+
+	undoing = true;
+	seq = e->seq;
+	while (e && e->seq == seq) {
+		if (e->insert == redo) {
+			mgoto(buf, e->y, e->off);
+			minsertstr(buf, e->text, e->len);
+		} else {
+			if (buf->swap) mswaprec(buf, false, e->y, e->off, NULL, e->len);
+			mdelete(buf, e->y, e->off, e->len);
+		}
+		mgoto(buf, e->y, e->off);
+		j->last = redo ? e : e->prev;
+		e = redo ? e->next : e->prev;
+	}
+	undoing = false;
+}
+
+void mdelete(struct Buffer *buf, int y, size_t off, size_t len) {
+	/* Delete len bytes from byte off of line y on, newlines join lines.
+	 * The rest of the last line moves up and the lines in between are
+	 * cut out in one go. */
+	struct Line *ln = mgetline(buf, y), *last;
+	size_t end, keep;
+	int idx, nchars;
+	bool same, ascii;
+
+	if (!ln) return;
+	if (off > ln->len) off = ln->len;
+
+	/* Find where the text ends, spans on the way stay as they are */
+	for (last = ln, end = off + len; end > last->len && last->next; last = last->next)
+		end -= last->len + 1;
+	if (end > last->len) end = last->len;
+	if (last->span) {
+		char *p = last->data, *nl;
+		int k = 0;
+		for (; (nl = memchr(p, '\n', last->data + end - p)); p = nl + 1) k++;
+		end -= p - last->data;
+		last = msplit(buf, last, k);
+	}
+
+	/* Count only the deleted characters, or the kept ones of the last
+	 * line if there are fewer, so checkpoints before off stay */
+	keep = last->len - end;
+	same = last == ln;
+	idx = mcharidx(ln, off);
+	if (same) nchars = ln->nchars - mcount(ln->data + off, end - off, &ascii);
+	else if (end < keep) nchars = idx + last->nchars - mcount(last->data, end, &ascii);
+	else nchars = idx + mcount(last->data + end, keep, &ascii);
+	ascii = ln->ascii && last->ascii;
+
+	/* The line may move, and last with it if it is the same one */
+	buf->curline = ln = mreserve(buf, ln, (same ? ln->len : off + keep) + 1);
+	if (same) {
+		memmove(ln->data + off, ln->data + end, keep + 1);
+	} else {
+		memcpy(ln->data + off, last->data + end, keep + 1);
+		mcutlines(buf, ln->next, last);
+	}
+	ln->len = off + keep;
+	ln->nchars = nchars;
+	ln->ascii = ascii;
+	mtouch(ln, idx);
+	mdirty(buf, y, y);
+}
+
+char* mcopy(struct Buffer *buf, int y, size_t off, size_t len, size_t *n) {
+	/* Copy len bytes from byte off of line y on, or as many as there are.
+	 * Lines are copied out of spans without making them. */
+	struct Line *ln = mgetline(buf, y);
+	char *text = malloc(len + 1);
+	size_t i = 0, o = off;
+
+	assert(text);
+	while (ln) {
+		size_t k = ln->len - (o < ln->len ? o : ln->len);
+		k = k < len - i ? k : len - i;
+		memcpy(text + i, ln->data + o, k);
+		i += k;
+		if (i == len || !ln->next) break;
+		text[i++] = '\n';
+		ln = ln->next;
+		o = 0;
+	}
+	text[i] = 0;
+	*n = i;
+	return text;
+}
+
+size_t mbytes(struct Buffer *buf, int y0, size_t off0, int y1, size_t off1) {
+	/* Number of bytes from byte off0 of line y0 to byte off1 of line y1 */
+	struct Line *last = mgetline(buf, y1), *ln = mgetline(buf, y0);
+	size_t n = 0;
+
+	if (!ln || !last) return 0;
+	for (; ln != last; ln = ln->next)
+		n += ln->len + 1;
+	return n + off1 - off0;
+}
+
+void mcut(struct Buffer *buf, int y, size_t off, size_t len) {
+	/* Delete len bytes from byte off of line y on and record them */
+	char *text;
+
+	if (!len || !mgetline(buf, y)) return;
+	text = mcopy(buf, y, off, len, &len);
+	mrecord(buf, false, y, off, text, len);
+	mdelete(buf, y, off, len);
+	free(text);
+}
+
+void mshift(struct Buffer *buf, int y0, int y1, int n) {
+	/* Indent lines y0 to y1 by n tabs, or take n levels of indentation
+	 * away if n is negative. The lines are changed where they are, and the
+	 * journal gets all of them before and after. */
+	struct Line *ln;
+	char *text;
+	size_t len;
+	int y;
+
+	y1 = min(y1, buf->numlines - 1);
+	if (y0 > y1 || y0 < 0) return;
+	ln = mgetline(buf, y1);
+	text = mcopy(buf, y0, 0, mbytes(buf, y0, 0, y1, ln->len), &len);
+	mrecord(buf, false, y0, 0, text, len);
+	free(text);
+
+	for (y = y0, ln = mgetline(buf, y0); y <= y1; ++y, ln = mnext(buf, ln)) {
+		bool cur = ln == buf->curline;
+		size_t lead = 0;
+		int i, j;
+
+		mtouch(ln, 0);
+		if (n > 0 && ln->len) {
+			ln = mreserve(buf, ln, ln->len + n + 1);
+			memmove(ln->data + n, ln->data, ln->len + 1);
+			memset(ln->data, '\t', n);
+			ln->len += n;
+			ln->nchars += n;
+		} else if (n < 0) {
+			/* A level is a tab, or up to tab_width spaces */
+			for (i = 0; i < -n && lead < ln->len; ++i) {
+				if (ln->data[lead] == '\t') lead++;
+				else for (j = 0; j < (int)tab_width && ln->data[lead] == ' '; ++j) lead++;
+			}
+			if (lead) {
+				ln = mreserve(buf, ln, ln->len + 1);
+				memmove(ln->data, ln->data + lead, ln->len - lead + 1);
+				ln->len -= lead;
+				ln->nchars -= lead;
+			}
+		}
+		if (cur) buf->curline = ln;
+	}
+
+	ln = mgetline(buf, y1);
+	text = mcopy(buf, y0, 0, mbytes(buf, y0, 0, y1, ln->len), &len);
+	mrecord(buf, true, y0, 0, text, len);
+	free(text);
+	mdirty(buf, y0, y1);
+	buf->cursor.c.x = min(buf->cursor.c.x, buf->curline->nchars);
+}
+
+void mdelchars(struct Buffer *buf, int n) {
+	/* Delete n characters after the cursor, or before it if n is negative.
+	 * Backwards, newlines count as characters and lines are joined. */
+	struct Line *ln = buf->curline;
+	int y = buf->cursor.c.y, idx;
+	size_t off, len;
+
+	if (!ln) return;
+	idx = min(max(buf->cursor.c.x, 0), ln->nchars);
+	off = moffset(ln, idx);
+
+	if (n > 0) {
+		mcut(buf, y, off, moffset(ln, min(idx + n, ln->nchars)) - off);
+		buf->cursor.c.x = idx;
+		return;
+	}
+
+	/* Walk back to where the deleted text starts */
+	len = off;
+	for (n = -n; n > idx && ln->prev; ) {
+		n -= idx + 1;
+		ln = mprev(buf, ln);
+		idx = ln->nchars;
+		len += ln->len + 1;
+		y--;
+	}
+	idx = max(idx - n, 0);
+	off = moffset(ln, idx);
+	mcut(buf, y, off, len - off);
+	buf->cursor.c.x = idx;
+	buf->cursor.c.y = y;
+	mmove(buf, 0, 0);
+}
+
+void minsertrep(struct Buffer *buf, const char *s, size_t len, int n) {
+	/* Insert text n times over at the cursor */
+	char *text;
+	int i;
+
+	if (n == 1) {
+		minsertstr(buf, s, len);
+		return;
+	}
+	text = malloc(len * n);
+	assert(text);
+	for (i = 0; i < n; ++i)
+		memcpy(text + len * i, s, len);
+	minsertstr(buf, text, len * n);
+	free(text);
+}
+
+bool mfind(struct Buffer *buf, const char *src) {
+	/* Go to the next match of src after the cursor, wrapping to the
+	 * beginning of the buffer once. Returns false if there is none. */
+	regmatch_t match;
+	struct Iter it;
+	int i;
+
+	if (!buf->curline || !mcompile(src)) return false;
+	miterat(buf, &it, mlineno(buf->curline));
+	for (i = 0; i <= buf->numlines; ++i) {
+		size_t off = i ? 0 : moffset(buf->curline, buf->cursor.c.x + 1);
+		if (mmatch(it.p, it.len, off, &match)) {
+			mshowmatch(buf, it.y, match.rm_so, match.rm_eo);
+			return true;
+		}
+		miternext(buf, &it);
+	}
+	return false;
+}
+
+void mgoto(struct Buffer *buf, int y, size_t off) {
+	/* Put the cursor at byte off of line y */
+	buf->curline = mgetline(buf, max(0, min(y, buf->numlines - 1)));
+	buf->cursor.c.x = buf->cursor.c.y = 0;
+	if (!buf->curline) return;
+	buf->cursor.c.y = mlineno(buf->curline);
+	buf->cursor.c.x = mcharidx(buf->curline, off);
+	mmove(buf, 0, 0);
+}
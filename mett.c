@@ -1,104 +1,145 @@
+#define _GNU_SOURCE
 #define _XOPEN_SOURCE
 #define _XOPEN_SOURCE_EXTENDED
 #include <assert.h>
 #include <ctype.h>
 #include <curses.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
 #include <math.h>
-#include <regex.h>
+#include <poll.h>
 #include <signal.h>
-#include <stdbool.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
-#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 #include <wctype.h>
+#include "mett.h"
+
+/* Number of slots in the table of command names, a power of two */
+#define NAME_SLOTS 256
+
+/* Sent by the terminal around pasted text */
+#define KEY_PASTE_BEGIN (KEY_MAX + 1)
+#define KEY_PASTE_END (KEY_MAX + 2)
+
+/* Latency histograms have 8 buckets per power of two nanoseconds */
+#define HIST_BUCKETS (8 * 40)
+
+/* Stages of the main loop that are timed */
+enum Stage {
+	STAGE_WAIT,      /* Waiting for a key */
+	STAGE_POLL,      /* Reading shell commands and pipes, searching */
+	STAGE_INPUT,     /* Handling a single key */
+	STAGE_PAINT,     /* All of repaint() */
+	STAGE_PAINTSTAT,
+	STAGE_PAINTCMD,
+	STAGE_PAINTBUF,
+	STAGE_LATENCY,   /* From reading a key until it shows on the screen */
+	NUM_STAGES
+};
 
-#define SWAP(X, Y, T) { T SWAP = X; X = Y; Y = SWAP; }
-
-enum Mode {
-	MODE_NORMAL,
-	MODE_INSERT,
-	MODE_SELECT,
-	MODE_COMMAND
+struct Action {
+	wchar_t *cmd;
+	int key;
+	void (*fn)();
+	union {
+		struct { int x, y; };
+		int i;
+		void *v;
+		enum Marker m;
+	} arg;
 };
 
-enum Marker {
-	MARKER_START,
-	MARKER_MIDDLE,
-	MARKER_END
+struct Bindings {
+	const struct Action *keys[KEY_MAX + 1]; /* First action bound to each key... */
+	const struct Action *aliases[KEY_MAX + 1]; /* ...that has a name too */
+	const struct Action *names[NAME_SLOTS]; /* Named actions, hashed by name */
 };
 
-struct Coord {
-	int x, y;
+struct Step {
+	const struct Action *ac;
+	int cnt;
+	char *arg; /* NULL if there is none */
+	bool shell; /* arg is a shell command whose output goes to ac */
 };
 
-struct Cursor {
-	struct Coord c; /* Cursor coordinate */
-	struct Coord v0; /* Visual selection start */
-	struct Coord v1; /* Visual selection end */
+struct Chain {
+	char *src; /* Command line the steps were parsed from */
+	struct Step *steps;
+	int nsteps;
 };
 
-struct Line {
-	struct Line *next, *prev;
-	size_t backbuf_size;
-	wchar_t data[];
+struct Job {
+	pid_t pid;
+	int fd;
+	struct Action ac; /* Action that receives the output */
+	int cnt;
+	struct Buffer *buf; /* Buffer the output is streamed into, if any */
+	struct Coord at; /* Where the next chunk of output is inserted */
+	unsigned seq; /* Edit sequence number of the command that started it */
+	char *out; /* Output collected so far */
+	size_t len, size;
 };
 
-struct Buffer {
-	char *path;
-	struct Buffer *next;
-	struct Line *curline;
-	struct Cursor cursor;
-	int starty;
-	int offsetx;
-	int numlines;
+struct Histogram {
+	uint64_t count, max;
+	uint64_t buckets[HIST_BUCKETS];
 };
 
-struct Action {
-	wchar_t *cmd;
-	int key;
-	void (*fn)();
-	union {
-		struct { int x, y; };
-		int i;
-		void *v;
-		enum Marker m;
-	} arg;
+struct Register {
+	char *text; /* Text that was yanked or cut last */
+	size_t len;
 };
 
-static int32_t min(int32_t, int32_t);
-static int32_t max(int32_t, int32_t);
+struct Typed {
+	char *text; /* Text typed or pasted since the last key that wasn't */
+	size_t len, size;
+	bool paste; /* Inside a bracketed paste */
+};
 
 static void msighandler(int);
+static int mscript(const char*, char**, int);
+static bool mscriptfile(const char*, const char*);
 
-static struct Buffer* mnewbuf();
-static void mfreebuf(struct Buffer*);
-static void mclearbuf(struct Buffer*);
-static int  mreadfile(struct Buffer*, const char*);
-static void mreadstr(struct Buffer*, const char*);
-
-static struct Line* mnewline(size_t backbuf_size);
-static void mfreeln(struct Buffer*, struct Line*);
-static struct Line* mresizeline(struct Line*, size_t);
-static struct Line* mfirstline(struct Buffer*);
-static int  mnumcols(struct Line*, int );
 static void mupdatecursor();
+static void minput(int, wint_t);
+static void mflushtyped();
 static void mcmdkey(wint_t);
-static void minsert(struct Buffer*, wint_t);
-static int  mindent(struct Line*, int);
-static void mmove(struct Buffer*, int, int);
-static void mjump(struct Buffer*, enum Marker);
-static void mselect(struct Buffer*, int, int, int, int);
 static void mrepeat(const struct Action*, int);
-static void mruncmd(wchar_t*);
+static void mrunaction(const struct Action*, int);
+static void mbindkeys();
+static unsigned mhash(const wchar_t*, size_t);
+static const struct Action* mkeyaction(wint_t);
+static const struct Action* mcmdaction(const wchar_t*, size_t);
+static void mruncmd(const char*);
+static bool mparsechain(struct Chain*, const char*);
+static void mrunchain(const struct Chain*);
+static void mfreechain(struct Chain*);
+static void mjobstart(const char*, const struct Action*, int, int);
+static bool mjobread();
+static void mjobinsert(const char*, size_t);
+static void mjobstop();
+static void msearch();
+static bool mselection(struct Coord*, struct Coord*);
+static bool myank(struct Coord*, size_t*, size_t*);
+static void mselend(int, int);
+static uint64_t mnow();
+static uint64_t mlap(enum Stage, uint64_t);
+static uint64_t mpercentile(const struct Histogram*, double);
+static void mprintstats(FILE*);
 
 static void mpaintstat();
-static void mpaintln(struct Buffer*, struct Line*, WINDOW*, int, int, bool);
+static void mpaintnum(struct Buffer*, WINDOW*, int, int);
+static void mpaintln(struct Buffer*, struct Line*, WINDOW*, int, int, int, bool, int, int);
 static void mpaintbuf(struct Buffer*, WINDOW*, bool);
 static void mpaintcmd();
 
@@ -108,6 +149,7 @@ static void handlemouse();
 static void quit();
 static void setmode();
 static void save();
+static void recover();
 static void readfile();
 static void readstr();
 static void print();
@@ -121,38 +163,65 @@ static void pgdown();
 static void cls();
 static void bufsel();
 static void bufdel();
+static void bufnum();
+static void gotoline();
 static void insert();
 static void freeln();
 static void append();
 static void newln();
+static void undo();
+static void again();
+static void stats();
+static void cut();
+static void yank();
+static void put();
+static void shift();
+static void pipesel();
 
 /* Global variables */
-static enum Mode mode = MODE_NORMAL;
 static WINDOW *bufwin, *statuswin, *cmdwin;
-static struct Buffer *curbuf, *cmdbuf;
 static int repcnt = 0;
+static bool fullpaint = true;
+static struct Job job;
+static struct Typed typed;
+static struct Register reg;
+static struct Bindings bindings;
+static struct Chain chain;
+static bool scripting, halted;
+static volatile sig_atomic_t quitsig; /* Set by msighandler, handled by the main loop */
+static struct Histogram histograms[NUM_STAGES];
+static const char *stage_names[NUM_STAGES] = {
+	"wait", "poll", "input", "repaint", " stat", " cmd", " buf", "key2paint"
+};
 
 /* We make all the declarations available to the user */
 #include "config.h"
 
 int main(int argc, char **argv) {
-	int i;
+	int i, r;
 	wint_t key;
+	struct sigaction sa = { .sa_handler = msighandler };
 
 	setlocale(LC_ALL, "");
+	mbindkeys();
+
+	if (argc > 2 && !strcmp(argv[1], "-s"))
+		return mscript(argv[2], argv + 3, argc - 3);
 
 	/* Init buffers */
-	cmdbuf = mnewbuf();
+	cmdbuf = mnewbuf(false);
 	minsert(cmdbuf, L' ');
 	cmdbuf->offsetx = 0;
-	signal(SIGHUP,  msighandler);
-	signal(SIGKILL, msighandler);
-	signal(SIGINT,  msighandler);
-	signal(SIGTERM, msighandler);
+	/* Without SA_RESTART a signal wakes up get_wch */
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGHUP,  &sa, NULL);
+	sigaction(SIGINT,  &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
 
-	curbuf = mnewbuf();
+	/* Every file gets a buffer of its own */
 	for (i = 1; i < argc; ++i)
-		mreadfile(curbuf, argv[i]);
+		mreadfile(mnewbuf(true), argv[i]);
+	curbuf = buffers.len ? buffers.list[0] : mnewbuf(true);
 
 	/* Init curses */
 	newterm(NULL, stderr, stderr);
@@ -164,6 +233,12 @@ int main(int argc, char **argv) {
 	use_default_colors();
 	mousemask(BUTTON1_CLICKED | REPORT_MOUSE_POSITION, NULL);
 
+	if (bracketed_paste) {
+		define_key("\033[200~", KEY_PASTE_BEGIN);
+		define_key("\033[201~", KEY_PASTE_END);
+		fputs("\033[?2004h", stderr);
+	}
+
 	if (use_colors && (use_colors = has_colors())) {
 		start_color();
 		for (i = 1; i < NUM_COLOR_PAIRS; ++i)
@@ -174,592 +249,917 @@ int main(int argc, char **argv) {
 	repaint();
 
 	for (;;) {
-		get_wch(&key);
-		if (key != (wint_t)ERR) {
-			switch (mode) {
-			case MODE_NORMAL:
-				/* Special keys will cancel action sequences */
-				if (key == ESC || key == '\n') repcnt = 0;
-				mcmdkey(key);
-				break;
-			case MODE_SELECT:
-				if (key == ESC) mode = MODE_NORMAL;
-				else mcmdkey(key);
-				break;
-			case MODE_INSERT:
-				if (key == ESC) mode = MODE_NORMAL;
-				else minsert(curbuf, key);
-				break;
-			case MODE_COMMAND:
-				if (key == ESC) {
-					mode = MODE_NORMAL;
-					mclearbuf(cmdbuf);
-					minsert(cmdbuf, L' ');
-					resize();
-				}
-				else minsert(cmdbuf, key);
-				break;
-			}
+		/* Poll running shell commands, pipes and searches without blocking the editor */
+		int delay = -1;
+		bool polled = job.pid || feeds;
+		uint64_t t = mnow(), t0;
+		if (quitsig) {
+			/* Ctrl-C quits on purpose, the edits go with it */
+			dying = quitsig != SIGINT;
+			quit();
+		}
+		if (job.pid) delay = mjobread() ? 0 : job_poll_interval;
+		if (feeds) delay = mfeedread() || !delay ? 0 : job_poll_interval;
+		if (msearchstep()) delay = 0, polled = true;
+		if (polled) t = mlap(STAGE_POLL, t);
+		wtimeout(stdscr, delay);
+
+		if ((r = get_wch(&key)) == ERR) {
 			repaint();
+			continue;
 		}
+		t0 = t = mlap(STAGE_WAIT, t);
+
+		/* Handle everything that was typed or pasted so far, then paint once */
+		wtimeout(stdscr, 0);
+		do {
+			minput(r, key);
+			t = mlap(STAGE_INPUT, t);
+		} while ((r = get_wch(&key)) != ERR);
+		mflushtyped();
+
+		/* Searching once for the whole burst is enough */
+		if (mode == MODE_COMMAND) msearch();
+		repaint();
+		mlap(STAGE_LATENCY, t0);
 	}
 
 	return 0;
 }
 
-int32_t min(int32_t a, int32_t b) {
-	return a < b ? a : b;
-}
-
-int32_t max(int32_t a, int32_t b) {
-	return a > b ? a : b;
+void msighandler(int signum) {
+	/* Nothing else is safe in here */
+	quitsig = signum;
 }
 
-void msighandler(int signum) {
-	switch (signum) {
-	case SIGHUP:
-	case SIGKILL:
-	case SIGINT:
-	case SIGTERM:
-		quit();
-		break;
+int mscript(const char *script, char **files, int nfiles) {
+	/* Run script on every file without a terminal. Worker processes take
+	 * the next file until there are none left, so no state is shared. */
+	atomic_int *next;
+	const char *p;
+	size_t len;
+	int i, nworkers = script_workers ? script_workers : sysconf(_SC_NPROCESSORS_ONLN);
+	int status, failed = 0;
+
+	scripting = true;
+	swap_files = backup_on_write = false;
+	cmdbuf = mnewbuf(false);
+
+	/* The whole script is checked before any file is touched */
+	for (p = script, failed = 0; *p; p += len + !!p[len]) {
+		struct Chain c = { 0 };
+		char *line = strndup(p, len = strcspn(p, "\n"));
+		assert(line);
+		failed |= !mparsechain(&c, line);
+		mfreechain(&c);
+		free(line);
+	}
+	if (failed) return 1;
+
+	next = mmap(NULL, sizeof(*next), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (next == MAP_FAILED) return 1;
+	atomic_init(next, 0);
+	nworkers = max(1, min(nworkers, nfiles));
+	fflush(stdout);
+
+	for (i = 0; i < nworkers; ++i) {
+		pid_t pid = nworkers > 1 ? fork() : 0;
+		if (pid < 0) {
+			failed = 1;
+			break;
+		}
+		if (!pid) {
+			int n;
+			while ((n = atomic_fetch_add(next, 1)) < nfiles)
+				failed |= !mscriptfile(script, files[n]);
+			fflush(stdout);
+			if (nworkers > 1) _exit(failed);
+			return failed;
+		}
 	}
+	while (wait(&status) > 0)
+		failed |= !WIFEXITED(status) || WEXITSTATUS(status);
+	return failed;
 }
 
-struct Buffer* mnewbuf() {
-	/* Create new buffer and insert at start of the list */
-	struct Buffer *next = NULL;
-	if (curbuf) next = curbuf;
-	if (!(curbuf = (struct Buffer*)calloc(sizeof(struct Buffer), 1))) return NULL;
-	curbuf->next = next;
-	curbuf->offsetx = 4;
-	mselect(curbuf, -1, -1, -1, -1);
-	return curbuf;
-}
+bool mscriptfile(const char *script, const char *path) {
+	/* Every line of the script is a command line. Changed buffers are saved
+	 * and whatever was printed to the command buffer goes to stdout. */
+	struct stat st;
+	struct Line *ln;
+	const char *err;
+	bool ok = true;
+	int i;
 
-void mfreebuf(struct Buffer *buf) {
-	free(buf->path);
-	mclearbuf(buf);
-}
+	if (stat(path, &st) ? (err = strerror(errno)) : !S_ISREG(st.st_mode) ? (err = "Not a regular file") : NULL) {
+		fprintf(stderr, "mett: %s: %s\n", path, err);
+		return false;
+	}
+	mreadfile((curbuf = mnewbuf(true)), path);
+	mode = MODE_NORMAL;
+	halted = false;
+
+	while (*script && !halted) {
+		size_t len = strcspn(script, "\n");
+		char *line = strndup(script, len);
+		assert(line);
+		editseq++; /* A line is undone as a whole, like a typed command */
+		mruncmd(line);
+		free(line);
+		script += len + !!script[len];
+
+		/* Shell commands have to finish before the next line runs */
+		while (job.pid) {
+			struct pollfd p = { job.fd, POLLIN, 0 };
+			poll(&p, 1, -1);
+			mjobread();
+		}
+	}
 
-void mclearbuf(struct Buffer *buf) {
-	struct Line *firstline, *ln;
-	if (!(firstline = mfirstline(buf))) return;
-	ln = firstline;
-	while (ln) {
-		struct Line *next = ln->next;
-		free(ln);
-		ln = next;
+	for (i = 0; i < buffers.len; ++i) {
+		struct Buffer *buf = buffers.list[i];
+		if (buf->changes && buf->path && !msave(buf, NULL)) {
+			fprintf(stderr, "mett: %s: %s\n", buf->path, strerror(errno));
+			ok = false;
+		}
 	}
-	buf->cursor.c.x = buf->cursor.c.y = 0;
-	buf->numlines = 0;
-	buf->curline = NULL;
-}
+	for (ln = mfirstline(cmdbuf); ln; ln = ln->next)
+		if (ln->len || ln->next) printf("%.*s\n", (int)ln->len, ln->data);
 
-int mreadfile(struct Buffer *buf, const char *path) {
-	FILE *fp = NULL;
+	mclearbuf(cmdbuf);
+	while (buffers.len)
+		mfreebuf(buffers.list[buffers.len - 1]);
+	curbuf = NULL;
+	return ok;
+}
 
-	if (path[0] == '-' && !path[1]) fp = stdin;
-	else fp = fopen(path, "r");
+void mupdatecursor() {
+	/* Place the cursor depending on the mode */
+	WINDOW *win = mode == MODE_COMMAND ? cmdwin : bufwin;
+	struct Buffer *buf = mode == MODE_COMMAND ? cmdbuf : curbuf;
+	int ncols = mnumcols(buf, buf->curline, buf->cursor.c.x);
+	if (buf->wrap) ncols %= buf->wrap;
+	wmove(win, mrowsabove(buf, getmaxy(win)), buf->offsetx + ncols);
+	wnoutrefresh(win);
+}
 
-	if (fp) {
-		wchar_t c;
-		int m = mode;
-		bool indent = auto_indent;
+void minput(int r, wint_t key) {
+	/* Text typed into a buffer is collected and inserted in one go, pasted
+	 * text goes in as it is, without auto-indent or running commands */
+	bool text = r == OK && (key >= ' ' || key == '\t') && key != 127;
 
-		auto_indent = FALSE;
-		mode = MODE_INSERT;
+	if (r == KEY_CODE_YES && (key == KEY_PASTE_BEGIN || key == KEY_PASTE_END)) {
+		mflushtyped();
+		typed.paste = key == KEY_PASTE_BEGIN;
+		return;
+	}
+	if (r == OK && key == ESC) typed.paste = false;
+
+	if (mode != MODE_COMMAND && (typed.paste ? text || key == '\n' : mode == MODE_INSERT && text)) {
+		char c[4];
+		size_t n = mutf8enc(key, c);
+		if (typed.len + n > typed.size) {
+			typed.size = typed.size * 2 + 256;
+			typed.text = realloc(typed.text, typed.size);
+			assert(typed.text);
+		}
+		memcpy(typed.text + typed.len, c, n);
+		typed.len += n;
+		return;
+	}
+	mflushtyped();
+	editseq++;
+
+	switch (mode) {
+	case MODE_NORMAL:
+		/* Special keys will cancel action sequences */
+		if (key == ESC || key == '\n') repcnt = 0;
+		/* Escape also cancels a running shell command */
+		if (key == ESC) mjobstop();
+		mcmdkey(key);
+		break;
+	case MODE_SELECT:
+		if (key == ESC) mselend(curbuf->cursor.c.x, curbuf->cursor.c.y);
+		else mcmdkey(key);
+		break;
+	case MODE_INSERT:
+		if (key == ESC) mode = MODE_NORMAL;
+		else minsert(curbuf, key);
+		break;
+	case MODE_COMMAND:
+		/* Submitting or leaving ends an incremental search */
+		if (key == ESC || key == '\n') msearchend();
+		if (key == ESC) {
+			mode = MODE_NORMAL;
+			mclearbuf(cmdbuf);
+			minsert(cmdbuf, L' ');
+			resize();
+		} else {
+			minsert(cmdbuf, key);
+			if (key == '\n') {
+				mruncmd(cmdbuf->curline->prev->data);
+				resize();
+			}
+		}
+		break;
+	}
+}
 
-		while ((c = fgetwc(fp)) != EOF)
-			minsert(buf, c);
+void mflushtyped() {
+	/* The whole run is one step, so runs typed one after another are
+	 * undone together */
+	if (!typed.len) return;
+	editseq++;
+	minsertstr(curbuf, typed.text, typed.len);
+	mmove(curbuf, 0, 0);
+	typed.len = 0;
+}
 
-		auto_indent = indent;
-		mode = m;
+void mcmdkey(wint_t key) {
+	/* Number keys (other than 0) are reserved for repetition */
+	if (isdigit(key) && !(key == '0' && !repcnt)) {
+		repcnt = min(10 * repcnt + (key - '0'), max_cmd_repetition);
+	} else {
+		const struct Action *ac = mkeyaction(key);
+		if (ac) {
+			mclearbuf(cmdbuf);
+			if (ac->cmd) {
+				const wchar_t *c;
+				for (c = ac->cmd; *c; ++c)
+					minsert(cmdbuf, *c);
+				mjump(cmdbuf, MARKER_END);
+			}
+			mrepeat(ac, repcnt ? repcnt : 1);
+		}
+		repcnt = 0;
 	}
+}
 
-	buf->curline = mfirstline(buf);
-	buf->path = (char*)calloc(strlen(path)+1, 1);
-	strcpy(buf->path, path);
-	if (fp) fclose(fp);
-
-	return 1;
+void mrepeat(const struct Action *ac, int n) {
+	/* Actions get the count and repeat themselves as they see fit */
+	ac->fn(ac, min(n, max_cmd_repetition));
 }
 
-void mreadstr(struct Buffer *buf, const char *str) {
-	int i, len, m = mode;
-	len = strlen(str);
+void mrunaction(const struct Action *ac, int cnt) {
+	/* FIXME: This is an ugly hack */
+	bool indent = auto_indent;
+	enum Mode m = mode;
+	auto_indent = FALSE;
 	mode = MODE_INSERT;
-	for (i = 0; i < len; ++i)
-		minsert(buf, str[i]);
+	mrepeat(ac, cnt);
 	mode = m;
+	auto_indent = indent;
 }
 
-struct Line* mnewline(size_t backbuf_size) {
-	struct Line *line = calloc(sizeof(struct Line) + backbuf_size, 1);
-	assert(line);
-	line->backbuf_size = backbuf_size;
-	return line;
-}
-
-void mfreeln(struct Buffer *buf, struct Line *ln) {
-	struct Line *next = NULL;
-
-	if (!ln) return;
-	if (ln->prev) {
-		ln->prev->next = ln->next;
-		next = ln->prev;
+void mbindkeys() {
+	/* Index the actions by key and by name. Like the table, the first
+	 * action bound to a key or name wins. */
+	size_t i, n = sizeof(buffer_actions) / sizeof(struct Action);
+	assert(n < NAME_SLOTS / 2);
+
+	for (i = n; i--; ) {
+		const struct Action *ac = &buffer_actions[i];
+		if (ac->key > 0 && ac->key <= KEY_MAX) {
+			bindings.keys[ac->key] = ac;
+			if (ac->cmd) bindings.aliases[ac->key] = ac;
+		}
 	}
-	if (ln->next) {
-		ln->next->prev = ln->prev;
-		next = ln->next;
+	for (i = 0; i < n; ++i) {
+		const struct Action *ac = &buffer_actions[i];
+		size_t len;
+		unsigned h;
+		if (!ac->cmd) continue;
+		len = wcslen(ac->cmd);
+		for (h = mhash(ac->cmd, len); bindings.names[h]; h = (h + 1) & (NAME_SLOTS - 1))
+			if (!wcscmp(bindings.names[h]->cmd, ac->cmd)) break;
+		if (!bindings.names[h]) bindings.names[h] = ac;
 	}
-
-	if (ln == buf->curline)
-		buf->curline = next;
-
-	free(ln);
-	buf->numlines--;
 }
 
-struct Line* mresizeline(struct Line *ln, size_t size) {
-	struct Line *prev = ln->prev, *next = ln->next;
-	ln = realloc(ln, sizeof(struct Line) + size);
-	assert(ln);
-	ln->backbuf_size = size;
-	if (prev)
-		prev->next = ln;
-	if (next)
-		next->prev = ln;
-	return ln;
+unsigned mhash(const wchar_t *s, size_t len) {
+	/* FNV-1a */
+	unsigned h = 2166136261u;
+	while (len--) h = (h ^ (unsigned)*s++) * 16777619u;
+	return h & (NAME_SLOTS - 1);
 }
 
-struct Line* mfirstline(struct Buffer *buf) {
-	struct Line *first = NULL, *ln = buf->curline;
-	while (ln) {
-		first = ln;
-		ln = ln->prev;
-	}
-	return first;
+const struct Action* mkeyaction(wint_t key) {
+	/* Action bound to a key, keys beyond the index are looked up the slow way */
+	size_t i;
+	if (key <= KEY_MAX) return key ? bindings.keys[key] : NULL;
+	for (i = 0; i < sizeof(buffer_actions) / sizeof(struct Action); ++i)
+		if (key == (wint_t)buffer_actions[i].key) return &buffer_actions[i];
+	return NULL;
 }
 
-int mnumcols(struct Line *ln, int end) {
-	/* Count number of columns until cursor */
-	int i, ncols;
-	for (i = ncols = 0; i < end; ++i) {
-		if (ln->data[i] == L'\t') ncols += tab_width;
-		else ncols += max(0, wcwidth(ln->data[i]));
+const struct Action* mcmdaction(const wchar_t *cmd, size_t len) {
+	/* Named action for a command, either by its full name or by its key */
+	unsigned h;
+	for (h = mhash(cmd, len); bindings.names[h]; h = (h + 1) & (NAME_SLOTS - 1)) {
+		const struct Action *ac = bindings.names[h];
+		if (!wcsncmp(ac->cmd, cmd, len) && !ac->cmd[len]) return ac;
 	}
-	return ncols;
+	if (len == 1 && (wint_t)cmd[0] <= KEY_MAX) return bindings.aliases[cmd[0]];
+	return NULL;
 }
 
-void mupdatecursor() {
-	/* Place the cursor depending on the mode */
-	WINDOW *win = mode == MODE_COMMAND ? cmdwin : bufwin;
-	struct Buffer *buf = mode == MODE_COMMAND ? cmdbuf : curbuf;
-	int ncols = mnumcols(buf->curline, buf->cursor.c.x);
-	wmove(win, buf->cursor.c.y - buf->starty, buf->offsetx + ncols);
-	wrefresh(win);
-}
+void mruncmd(const char *line) {
+	/* Command lines are only parsed the first time they are run */
+	struct Chain c = { 0 };
+	int i;
 
-void mcmdkey(wint_t key) {
-	/* Number keys (other than 0) are reserved for repetition */
-	if (isdigit(key) && !(key == '0' && !repcnt)) {
-		repcnt = min(10 * repcnt + (key - '0'), max_cmd_repetition);
+	if (chain.src && !strcmp(chain.src, line)) {
+		mrunchain(&chain);
+		return;
+	}
+	mparsechain(&c, line);
+
+	/* A line of nothing but again replays the one before it */
+	for (i = 0; i < c.nsteps && c.steps[i].ac->fn == again; ++i);
+	if (chain.src && i == c.nsteps) {
+		mrunchain(&c);
+		mfreechain(&c);
 	} else {
-		size_t i;
-		for (i = 0; i < (size_t)(sizeof(buffer_actions) / sizeof(struct Action)); ++i) {
-			if (key == (wint_t)buffer_actions[i].key) {
-				mclearbuf(cmdbuf);
-				if (buffer_actions[i].cmd) {
-					size_t j, len;
-					len = wcslen(buffer_actions[i].cmd);
-					for (j = 0; j < len; ++j)
-						minsert(cmdbuf, buffer_actions[i].cmd[j]);
-					mjump(cmdbuf, MARKER_END);
-				}
-				mrepeat(&buffer_actions[i], repcnt ? repcnt : 1);
-			}
-		}
-		repcnt = 0;
+		mfreechain(&chain);
+		chain = c;
+		mrunchain(&chain);
 	}
 }
 
-void minsert(struct Buffer *buf, wint_t key) {
-	size_t idx, len = 0;
-	struct Line *ln = buf->curline;
-
-	/* Create or resize the current line if needed. */
-	if (!ln) {
-		ln = buf->curline = mnewline(default_linebuf_size);
-		buf->numlines = 1;
-	} else {
-		len = wcslen(ln->data);
-		if ((len+1) * sizeof(wchar_t) >= ln->backbuf_size)
-			ln = buf->curline = mresizeline(ln, ln->backbuf_size * 2);
-	}
-
-	idx = min(buf->cursor.c.x, len);
-
-	switch (key) {
-	case '\b':
-	case 127:
-	case KEY_BACKSPACE:
-		if (idx) {
-			memcpy(&ln->data[idx-1], &ln->data[idx], (len - idx + 1) * sizeof(wchar_t));
-			buf->cursor.c.x--;
-		} else if (ln->prev) {
-			int plen = wcslen(ln->prev->data);
-			if (ln->prev->backbuf_size <= plen + ln->backbuf_size)
-				ln->prev = mresizeline(ln->prev, ln->prev->backbuf_size + ln->backbuf_size);
-			wcscpy(ln->prev->data+plen, ln->data);
-			mmove(buf, plen + buf->cursor.c.x, -1);
-			buf->curline = ln->prev;
-			mfreeln(buf, ln);
-			buf->numlines--;
+bool mparsechain(struct Chain *c, const char *line) {
+	/* Split a command line into steps separated by ';'. "\\;" is a ';' in an
+	 * argument, and a shell command (!cmd) takes the rest of the line.
+	 * Unknown commands are left out, false if there were any. */
+	wchar_t *buf, *p;
+	int i, size = 0;
+	bool ok = true;
+
+	c->src = strdup(line);
+	assert(c->src);
+
+	/* Commands are parsed as wide characters */
+	buf = malloc((strlen(line) + 1) * sizeof(wchar_t));
+	assert(buf);
+	for (i = 0; *line; ++i)
+		line += mutf8dec(line, &buf[i]);
+	buf[i] = 0;
+
+	for (p = buf; *p; ) {
+		struct Step st = { 0 };
+		wchar_t *cmd, *arg, *end;
+		size_t cmdlen, n;
+
+		/* Parse decimal repetition count */
+		if (!(st.cnt = wcstol(p, &cmd, 10))) st.cnt = 1;
+		while (*cmd == L' ') cmd++;
+		for (cmdlen = 0; cmd[cmdlen] && !wcschr(L" !;", cmd[cmdlen]); ++cmdlen);
+
+		/* Parse optional argument */
+		arg = end = p = cmd + cmdlen;
+		if (*arg == L' ') arg = end = ++p;
+		if ((st.shell = *arg == L'!')) {
+			arg = ++p;
+			end = p += wcslen(p);
+		} else {
+			for (; *p && *p != L';'; *end++ = *p++)
+				if (p[0] == L'\\' && p[1] == L';') p++;
+			if (*p) p++;
 		}
-		break;
-	case KEY_DC:
-		memcpy(&ln->data[idx], &ln->data[idx+1], (len - idx + 1) * sizeof(wchar_t));
-		break;
-	case '\n':
-		{
-			int ox = 0;
-			struct Line *old = ln;
-			ln = mnewline(old->backbuf_size);
-			ln->next = old->next;
-			ln->prev = old;
-			if (old->next) old->next->prev = ln;
-			old->next = ln;
-
-			if (auto_indent) {
-				/* Indent to the last position */
-				size_t x, mx;
-				for (x = mx = 0; x < idx; ++x) {
-					if (old->data[x] == L'\t') mx += tab_width;
-					else if (iswspace(old->data[x])) mx++;
-					else break;
-				}
-				ox = mindent(ln, mx);
-			}
-
-			memcpy(&ln->data[ox], &old->data[idx], (len - idx + 1) * sizeof(wchar_t));
-			old->data[idx] = 0;
-			mjump(buf, MARKER_START);
-			mmove(buf, ox, +1);
-
-			if (mode == MODE_COMMAND) {
-				mruncmd(cmdbuf->curline->prev->data);
-				resize();
-			}
 
-			buf->numlines++;
+		if (!(st.ac = mcmdaction(cmd, cmdlen))) {
+			if (cmdlen && scripting) fprintf(stderr, "mett: %.*ls: Unknown command\n", (int)cmdlen, cmd);
+			ok = ok && !cmdlen;
+			continue;
 		}
-		break;
-	default:
-		{
-			if (len) memcpy(&ln->data[idx + 1], &ln->data[idx], (len - idx + 1) * sizeof(wchar_t));
-			ln->data[idx] = key;
-			buf->cursor.c.x++;
+		if (end > arg || st.shell) {
+			st.arg = malloc((end - arg) * 4 + 1);
+			assert(st.arg);
+			for (n = 0; arg < end; ++arg)
+				n += mutf8enc(*arg, st.arg + n);
+			st.arg[n] = 0;
 		}
-		break;
-	}
-}
 
-int mindent(struct Line *ln, int n) {
-	int i, j, tabs, spaces;
+		if (c->nsteps == size) {
+			size = size * 2 + 4;
+			c->steps = realloc(c->steps, size * sizeof(struct Step));
+			assert(c->steps);
+		}
+		c->steps[c->nsteps++] = st;
+	}
 
-	tabs = n / tab_width;
-	spaces = n % tab_width;
+	free(buf);
+	return ok;
+}
 
-	for (i = 0; i < tabs; ++i)
-		ln->data[i] = L'\t';
-	for (j = 0; j < spaces; ++j)
-		ln->data[i+j] = L' ';
+void mrunchain(const struct Chain *c) {
+	int i;
+	for (i = 0; i < c->nsteps && !halted; ++i) {
+		const struct Step *st = &c->steps[i];
+		struct Action ac = *st->ac;
+		if (st->arg) ac.arg.v = st->arg;
+		if (st->shell) mjobstart(st->arg, &ac, st->cnt, -1);
+		else mrunaction(&ac, st->cnt);
+	}
+}
 
-	return tabs + spaces;
+void mfreechain(struct Chain *c) {
+	int i;
+	for (i = 0; i < c->nsteps; ++i)
+		free(c->steps[i].arg);
+	free(c->steps);
+	free(c->src);
+	memset(c, 0, sizeof(*c));
 }
 
-void mmove(struct Buffer *buf, int x, int y) {
-	int i, len;
-	int row;
+void mjobstart(const char *cmd, const struct Action *ac, int cnt, int in) {
+	/* Run cmd in the background and feed its output to ac. Its input
+	 * comes from in, or from /dev/null if that is -1. */
+	int fds[2];
+	pid_t pid;
+
+	mjobstop();
+	if (pipe(fds)) return;
+	if ((pid = fork()) < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return;
+	}
 
-	if (!buf->curline) return;
+	if (!pid) {
+		int null = open("/dev/null", O_RDWR);
+		setpgid(0, 0);
+		dup2(in >= 0 ? in : null, STDIN_FILENO);
+		dup2(fds[1], STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+		_exit(127);
+	}
 
-	row = getmaxy(bufwin);
+	setpgid(pid, pid);
+	close(fds[1]);
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	memset(&job, 0, sizeof(job));
+	job.pid = pid;
+	job.fd = fds[0];
+	job.ac = *ac;
+	job.cnt = cnt;
+	job.seq = editseq;
+
+	/* Inserted text is streamed in, everything else needs the whole output */
+	if (ac->fn == readstr && cnt == 1) {
+		job.buf = curbuf;
+		job.at = curbuf->cursor.c;
+	}
+}
 
-	/* left / right */
-	buf->cursor.c.x += x;
+bool mjobread() {
+	/* Consume at most job_read_budget bytes of output, returns true if
+	 * there was any. The action is run once the command has finished. */
+	size_t total = 0;
+	ssize_t n;
 
-	/* up / down */
-	if (y < 0) {
-		for (i = 0; i < abs(y); ++i) {
-			if (buf->curline->prev) {
-				buf->curline = buf->curline->prev;
-				buf->cursor.c.y--;
-			} else break;
-			if (buf->cursor.c.y < buf->starty) {
-				/* Scroll the view up */
-				buf->starty--;
-			}
+	do {
+		if (job.len + file_block_size + 1 > job.size) {
+			job.size = job.size * 2 + file_block_size + 1;
+			job.out = realloc(job.out, job.size);
+			assert(job.out);
 		}
-	} else {
-		for (i = 0; i < y; ++i) {
-			if (buf->curline->next) {
-				buf->curline = buf->curline->next;
-				buf->cursor.c.y++;
-			} else break;
-			if (buf->cursor.c.y - buf->starty >= row) {
-				/* Scroll the view down */
-				buf->starty++;
+		if ((n = read(job.fd, job.out + job.len, file_block_size)) > 0) {
+			job.len += n;
+			total += n;
+			if (job.buf) {
+				/* Hold back a character that is split between two reads,
+				 * and a newline that may turn out to be the last one */
+				size_t keep = mutf8tail(job.out, job.len);
+				if (!keep && job.out[job.len - 1] == '\n') keep = 1;
+				mjobinsert(job.out, job.len - keep);
+				memmove(job.out, job.out + job.len - keep, keep);
+				job.len = keep;
 			}
 		}
+	} while (n > 0 && total < job_read_budget);
+
+	if (!n || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		struct Job done = job;
+		/* Like $(cmd), drop the final newline */
+		if (job.buf) mjobinsert(job.out, job.len - (job.len && job.out[job.len - 1] == '\n'));
+		job.out = NULL;
+		mjobstop();
+		if (!done.buf) {
+			if (done.len && done.out[done.len-1] == '\n') done.len--;
+			done.out[done.len] = 0;
+			done.ac.arg.v = done.out;
+			mrunaction(&done.ac, done.cnt);
+		}
+		free(done.out);
 	}
+	return total > 0;
+}
 
-	/* Restrict cursor to line content */
-	len = wcslen(buf->curline->data);
-	buf->cursor.c.x = max(min(buf->cursor.c.x, len), 0);
+void mjobinsert(const char *s, size_t len) {
+	/* Insert output at the job's position, leaving the user's cursor alone */
+	struct Buffer *buf = job.buf;
+	struct Cursor cursor = buf->cursor;
+	int numlines = buf->numlines;
+	unsigned seq = editseq;
+
+	if (!len) return;
+	editseq = job.seq; /* The output is undone in one go */
+	buf->cursor.c = job.at;
+	buf->curline = mgetline(buf, min(job.at.y, numlines - 1));
+	minsertstr(buf, s, len);
+	editseq = seq;
+	job.at = buf->cursor.c;
+	if (search.src && search.buf == buf) msearchrestart();
+
+	if (numlines && cursor.c.y > job.at.y - (buf->numlines - numlines))
+		cursor.c.y += buf->numlines - numlines;
+	buf->cursor = cursor;
+	buf->curline = mgetline(buf, max(0, min(cursor.c.y, buf->numlines - 1)));
+}
+
+void mjobstop() {
+	/* Give the command a moment to exit on its own before killing it for
+	 * good, a stuck one doesn't get to hang the editor */
+	struct timespec nap = { 0, job_poll_interval * 1000000L };
+	pid_t r;
+	int i;
 
-	/* Update selection end */
-	if (mode == MODE_SELECT) {
-		buf->cursor.v1 = (struct Coord){buf->cursor.c.x, buf->cursor.c.y};
+	if (!job.pid) return;
+	kill(-job.pid, SIGTERM);
+	close(job.fd);
+	for (i = 0; (r = waitpid(job.pid, NULL, WNOHANG)) != job.pid; ++i) {
+		if (r < 0 && errno != EINTR) break;
+		if (i == 5) kill(-job.pid, SIGKILL);
+		nanosleep(&nap, NULL);
 	}
+	free(job.out);
+	memset(&job, 0, sizeof(job));
 }
 
-void mjump(struct Buffer *buf, enum Marker mark) {
-	switch(mark) {
-	case MARKER_START:
-		buf->cursor.c.x = 0;
-		break;
-	case MARKER_MIDDLE:
-		{
-			struct Line *ln = buf->curline;
-			if (!ln) return;
-			size_t len = wcslen(ln->data);
-			buf->cursor.c.x = (len/2);
-		}
-		break;
-	case MARKER_END:
-		{
-			struct Line *ln = buf->curline;
-			if (!ln) return;
-			size_t len = wcslen(ln->data);
-			buf->cursor.c.x = max(len, 0);
-		}
-		break;
+void msearch() {
+	/* Search incrementally while a find command is being typed */
+	const char *s = cmdbuf->curline ? cmdbuf->curline->data : "";
+	const struct Action *ac = NULL;
+	wchar_t cmd[16];
+	char *src, *d;
+	size_t i, n;
+	bool narrow;
+
+	/* Only the first command of a chain is searched for */
+	s += strspn(s, " 0123456789");
+	n = strcspn(s, " !;");
+	for (i = 0; i < n && i < sizeof(cmd) / sizeof(wchar_t); ++i)
+		cmd[i] = (unsigned char)s[i];
+	if (i == n) ac = mcmdaction(cmd, n);
+	if (!ac || ac->fn != find || s[n] != ' ' || !s[n+1] || s[n+1] == ';') {
+		msearchend();
+		return;
+	}
+
+	/* The pattern ends at the first ';' that isn't escaped */
+	src = strdup(s + n + 1);
+	assert(src);
+	for (s = d = src; *s && *s != ';'; *d++ = *s++)
+		if (s[0] == '\\' && s[1] == ';') s++;
+	*d = 0;
+	if (search.src && !strcmp(search.src, src)) {
+		free(src);
+		return;
+	}
+
+	if (!search.src) {
+		search.buf = curbuf;
+		search.from = curbuf->cursor;
+	}
+
+	/* Matches of a longer pattern are a subset of the previous matches
+	 * if only plain characters were added */
+	n = search.src ? strlen(search.src) : 0;
+	narrow = search.valid && !strncmp(search.src, src, n) && (!n || search.src[n-1] != '\\')
+		&& !src[n + strcspn(src + n, "\\*[{")];
+
+	free(search.src);
+	search.src = src;
+	search.valid = mcompile(src);
+	search.found = false;
+	mdirty(search.buf, 0, INT_MAX);
+
+	if (narrow) {
+		/* Candidates that weren't checked yet stay candidates */
+		while (search.icand < search.ncand)
+			msearchhit(search.cand[search.icand++]);
+		SWAP(search.cand, search.hits, int*);
+		SWAP(search.ncandsize, search.nhitsize, int);
+		search.ncand = search.nhits;
+		search.icand = search.nhits = 0;
+	} else {
+		msearchrestart();
 	}
+	msearchstep();
+	/* Stay where we started until there is a match */
+	if (!search.found) msearchback();
 }
 
-void mselect(struct Buffer *buf, int x1, int y1, int x2, int y2) {
-	buf->cursor.v0 = (struct Coord){ x1, y1 };
-	buf->cursor.v1 = (struct Coord){ x2, y2 };
+bool mselection(struct Coord *from, struct Coord *to) {
+	/* The selection from its first to its last character, false if there
+	 * is none. A match that was found counts as one too, until the cursor
+	 * leaves it. */
+	struct Coord c = curbuf->cursor.c;
+	*from = curbuf->cursor.v0;
+	*to = curbuf->cursor.v1;
+	if (!curbuf->curline || from->y < 0 || to->y < 0) return false;
+	if ((c.x != from->x || c.y != from->y) && (c.x != to->x || c.y != to->y)) return false;
+	if (to->y < from->y || (to->y == from->y && to->x < from->x))
+		SWAP(*from, *to, struct Coord);
+	to->y = min(to->y, curbuf->numlines - 1);
+	return true;
 }
 
-void mrepeat(const struct Action *ac, int n) {
-	int i;
-	n = min(n, max_cmd_repetition);
-	for (i = 0; i < n; ++i)
-		ac->fn(ac);
+bool myank(struct Coord *a, size_t *off, size_t *len) {
+	/* Copy the selection into the register, and find where it starts and
+	 * how long it is. The last character of a line takes its newline. */
+	struct Coord b;
+	struct Line *ln;
+
+	if (!mselection(a, &b)) return false;
+	*off = moffset(mgetline(curbuf, a->y), a->x);
+	ln = mgetline(curbuf, b.y);
+	*len = mbytes(curbuf, a->y, *off, b.y, moffset(ln, min(b.x + 1, ln->nchars)));
+	*len += b.x >= ln->nchars && ln->next;
+	free(reg.text);
+	reg.text = mcopy(curbuf, a->y, *off, *len, &reg.len);
+	return true;
 }
 
-char* mexec(const char *cmd) {
-	/* Execute cmd and return stdout.
-	 * TODO: Get rid of the fixed buffer. */
-	FILE *fp;
-	static char buf[1024 * 1024 * 4];
+void mselend(int x, int y) {
+	/* Drop the selection after working on it, and put the cursor at x, y */
+	if (mode == MODE_SELECT) mode = MODE_NORMAL;
+	mselect(curbuf, -1, -1, -1, -1);
+	curbuf->curline = mgetline(curbuf, y);
+	curbuf->cursor.c.x = x;
+	curbuf->cursor.c.y = y;
+	mmove(curbuf, 0, 0);
+}
 
-	fp = popen(cmd, "r");
-	if (!fp) return NULL;
+uint64_t mnow() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+uint64_t mlap(enum Stage stage, uint64_t start) {
+	/* Count the time since start for a stage, and start the next one */
+	struct Histogram *h = &histograms[stage];
+	uint64_t t = mnow(), ns = t - start;
+	int e = 3, i = ns;
 
-	fread(buf, 1, sizeof(buf), fp);
-	pclose(fp);
-	
-	return buf;
+	if (ns >= 8) {
+		/* Eight buckets for every power of two, so we're within 12% */
+		while (ns >> (e + 1)) e++;
+		i = min((e - 2) * 8 + (int)((ns >> (e - 3)) & 7), HIST_BUCKETS - 1);
+	}
+	h->buckets[i]++;
+	h->count++;
+	h->max = ns > h->max ? ns : h->max;
+	return t;
 }
 
-void mruncmd(wchar_t *buf) {
-	wchar_t *cmd = NULL;
-	char *arg = NULL;
-	int cnt, exlen, cmdlen;
+uint64_t mpercentile(const struct Histogram *h, double p) {
+	/* Upper bound of the bucket the percentile falls into */
+	uint64_t rank = ceil(p * h->count), n = 0;
 	int i;
+	for (i = 0; i < HIST_BUCKETS - 1 && (n += h->buckets[i]) < rank; ++i);
+	i++;
+	n = i < 8 ? (uint64_t)i : (uint64_t)(8 + i % 8) << (i / 8 - 1);
+	return n < h->max ? n : h->max;
+}
 
-	/* Parse decimal repetition count */
-	if (!(cnt = wcstol(buf, &cmd, 10))) cnt = 1;
-
-	/* Find length of command */
-	exlen = wcslen(cmd);
-	if (!exlen) return;
-
-	for (cmdlen = 0; cmdlen < exlen; ++cmdlen) {
-			if ((cmd[cmdlen] == L' ' && cmdlen) || cmd[cmdlen] == L'!') break;
-	}
-
-	/* Parse optional argument */
-	if (exlen > cmdlen) {
-		const wchar_t *warg = cmd + cmdlen;
-		if (warg[0] == L' ') warg++;
-		arg = (char*)malloc((exlen - cmdlen) * 4);
-		wcsrtombs(arg, &warg, (exlen - cmdlen) * 4, NULL);
-	}
-
-	if (cmd[0] == L' ') {
-			cmd++;
-			cmdlen--;
-	}
-
-	/* Is it a builtin command? */
-	for (i = 0; i < (int)(sizeof(buffer_actions) / sizeof(struct Action)); ++i) {
-		if (buffer_actions[i].cmd) {
-			/* Check for valid command */
-			if (/* Either the single-char keyboard shortcut... */
-			    (cmdlen == 1 && buffer_actions[i].key == cmd[0]) ||
-			    /* ...or the full command */
-			    ((unsigned)cmdlen == wcslen(buffer_actions[i].cmd) && !wcsncmp(buffer_actions[i].cmd, cmd, cmdlen))) {
-				struct Action ac;
-				memcpy(&ac, &buffer_actions[i], sizeof(struct Action));
-				if (arg) {
-					/* Check for shell command */
-					if (arg[0] == '!') ac.arg.v = mexec(arg+1);
-					else ac.arg.v = arg;
-				}
-
-				/* FIXME: This is an ugly hack */
-				bool indent = auto_indent;
-				auto_indent = FALSE;
-				mode = MODE_INSERT;
-				mrepeat(&ac, cnt);
-				mode = MODE_COMMAND;
-				auto_indent = indent;
-				/* TODO: Parse next command in chain */
-				break;
-			}
-		}
+void mprintstats(FILE *fp) {
+	int i;
+	fprintf(fp, "%-9s %8s %10s %10s %10s\n", "stage", "count", "p50", "p99", "max");
+	for (i = 0; i < NUM_STAGES; ++i) {
+		const struct Histogram *h = &histograms[i];
+		fprintf(fp, "%-9s %8llu %8.3fms %8.3fms %8.3fms\n", stage_names[i],
+			(unsigned long long)h->count, mpercentile(h, 0.5) / 1e6,
+			mpercentile(h, 0.99) / 1e6, h->max / 1e6);
 	}
-
-	free(arg);
 }
 
 void mpaintstat() {
+	static char lastleft[256], lastright[32];
 	struct Buffer *cur = curbuf;
+	struct Feed *f;
 	int col, bufsize;
-	char textbuf[32];
+	char left[sizeof(lastleft)], right[sizeof(lastright)];
 	char *bufname = "~scratch~";
 	const char *modes[] = { "NORMAL", "INSERT", "SELECT", "COMMAND" };
 
+	/* Buffer name, buffer length */
+	if (curbuf && curbuf->path) bufname = curbuf->path;
+	snprintf(left, sizeof(left), "%s, %i lines", bufname, curbuf->numlines);
+	for (f = feeds; f && f->buf != curbuf; f = f->next);
+	if (f) {
+		/* Still reading from a pipe */
+		size_t n = strlen(left);
+		if (f->total < 1 << 20) snprintf(left + n, sizeof(left) - n, ", reading (%zu KiB)", f->total >> 10);
+		else snprintf(left + n, sizeof(left) - n, ", reading (%.1f MiB)", f->total / 1048576.0);
+	}
+
+	/* Mode, cursor pos */
+	cur = mode == MODE_COMMAND ? cmdbuf : curbuf;
+	bufsize = snprintf(right, sizeof(right), "%s %d:%d", modes[mode], cur ? cur->cursor.c.y : 0, cur ? cur->cursor.c.x : 0);
+
+	/* Only repaint when a field has changed */
+	if (!fullpaint && !strcmp(left, lastleft) && !strcmp(right, lastright)) return;
+	strcpy(lastleft, left);
+	strcpy(lastright, right);
+
 	col = getmaxx(stdscr);
+	werase(statuswin);
 	if (use_colors) wattron(statuswin, COLOR_PAIR(PAIR_STATUS_BAR));
 
 	/* Background */
 	whline(statuswin, ' ', col);
 
-	/* Buffer name, buffer length */
 	if (use_colors) wattron(statuswin, COLOR_PAIR(PAIR_STATUS_BAR));
+	wprintw(statuswin, "%s", left);
 
-	if (curbuf && curbuf->path) bufname = curbuf->path;
-	wprintw(statuswin, "%s, %i lines", bufname, curbuf->numlines);
-
-	/* Mode, cursor pos */
-	cur = mode == MODE_COMMAND ? cmdbuf : curbuf;
-	bufsize = snprintf(textbuf, sizeof(textbuf), "%s %d:%d", modes[mode], cur ? cur->cursor.c.y : 0, cur ? cur->cursor.c.x : 0);
 	if (use_colors) wattron(statuswin, COLOR_PAIR(PAIR_STATUS_HIGHLIGHT));
-	mvwprintw(statuswin, 0, col - bufsize, "%s", textbuf);
+	mvwprintw(statuswin, 0, col - bufsize, "%s", right);
 	if (use_colors) wattroff(statuswin, COLOR_PAIR(PAIR_STATUS_HIGHLIGHT));
 
 	if (use_colors) wattroff(statuswin, COLOR_PAIR(PAIR_STATUS_BAR));
-	wrefresh(statuswin);
+	wnoutrefresh(statuswin);
 }
 
-void mpaintln(struct Buffer *buf, struct Line *ln, WINDOW *win, int y, int n, bool numbers) {
-	size_t x, len;
-	size_t i, j;
-	size_t col;
-
-	col = getmaxx(win);
-	x = buf->offsetx;
-	len = wcslen(ln->data);
-
+void mpaintnum(struct Buffer *buf, WINDOW *win, int y, int n) {
 	if (use_colors) wattron(win, COLOR_PAIR(PAIR_LINE_NUMBERS));
-	if (numbers && line_numbers) mvwprintw(win, y, 0, "%d", n);
+	mvwprintw(win, y, 0, "%-*d", buf->offsetx, n);
 	if (use_colors) wattroff(win, COLOR_PAIR(PAIR_LINE_NUMBERS));
+}
 
-	for (i = 0; i < len; ++i) {
-		wchar_t c = ln->data[i];
-		int abs_y = y + buf->starty;
-		int abs_x = x - buf->offsetx;
-
-		/* When we hit the right edge of the screen,
-		 * we wrap to the beginning of the next line */
-		if (x >= col) {
-			x = buf->offsetx;
-			y++;
+void mpaintln(struct Buffer *buf, struct Line *ln, WINDOW *win, int y, int row0, int n,
+		bool numbers, int sel0, int sel1) {
+	/* Paint a line from its screen row row0 on, in runs of characters that
+	 * look the same, one call per run, expanding tabs on the way.
+	 * Characters sel0 to sel1 (not included) are selected. Without
+	 * wrapping the line is cut off at the right edge. */
+	wchar_t run[256];
+	int base = getattrs(win), attr = base;
+	int wrap = buf->wrap, col = getmaxx(win) - buf->offsetx, rows = getmaxy(win) - y;
+	int pos, len = 0, idx = 0, rx = 0, ry = 0, nx = -1;
+	size_t off = 0, start;
+
+	if (numbers && line_numbers && !row0) mpaintnum(buf, win, y, n);
+
+	/* Start at the first character of the row */
+	pos = wrap ? row0 * wrap : 0;
+	if (pos) off = moffset(ln, idx = mcolidx(buf, ln, pos));
+	start = off;
+
+	/* Find the matches to highlight while searching */
+	regmatch_t hl[32];
+	int nhl = 0, ihl = 0;
+	if (buf == search.buf && search.valid) {
+		regmatch_t m;
+		for (off = start; nhl < 32 && off < ln->len; ) {
+			if (regexec(&pattern.reg, ln->data + off, 1, &m, off ? REG_NOTBOL : 0)) break;
+			if (m.rm_eo == m.rm_so) {
+				/* Skip empty matches */
+				off += m.rm_so + mutf8len(ln->data + off + m.rm_so);
+				continue;
+			}
+			hl[nhl].rm_so = off + m.rm_so;
+			hl[nhl++].rm_eo = off += m.rm_eo;
 		}
+	}
 
-		/* Highlight the current selection */
-		struct Coord sel_start = buf->cursor.v0;
-		struct Coord sel_end = buf->cursor.v1;
-		if (sel_end.x < sel_start.x) SWAP(sel_start.x, sel_end.x, int);
-		if (sel_end.y < sel_start.y) SWAP(sel_start.y, sel_end.y, int);
-		if (abs_y >= sel_start.y &&
-				abs_y <= sel_end.y &&
-				abs_x >= sel_start.x &&
-				abs_x <= sel_end.x) {
-			wattron(win, COLOR_PAIR(PAIR_BUFFER_CONTENTS));
+	for (off = start; off < ln->len; ++idx) {
+		wchar_t c;
+		bool tab;
+		int a = base, w, j, x, r;
+
+		while (ihl < nhl && (regoff_t)off >= hl[ihl].rm_eo) ihl++;
+		if (ihl < nhl && (regoff_t)off >= hl[ihl].rm_so)
+			a = (base & ~A_COLOR) | COLOR_PAIR(PAIR_SEARCH_MATCH);
+		if (idx >= sel0 && idx < sel1)
+			a = (base & ~A_COLOR) | COLOR_PAIR(PAIR_BUFFER_CONTENTS);
+
+		if (ln->ascii) c = ln->data[off++];
+		else off += mutf8dec(ln->data + off, &c);
+
+		tab = c == L'\t' || c == L'\n' || !c;
+		w = mwidth(c);
+		pos = mplace(pos, w, wrap);
+		r = wrap ? pos / wrap - row0 : 0;
+		x = buf->offsetx + (wrap ? pos % wrap : pos);
+		if (r >= rows || (!wrap && pos + w > col)) break;
+
+		/* Start a new run when the attribute or row changes, or this one is full */
+		if (a != attr || r != ry || x != nx || len + w > (int)(sizeof(run) / sizeof(*run))) {
+			if (len) mvwaddnwstr(win, y + ry, rx, run, len);
+			wattrset(win, attr = a);
+			rx = x;
+			ry = r;
+			len = 0;
 		}
-
-		switch (c) {
-			case L'\0':
-			case L'\n':
-			case L'\t':
-			{
-				cchar_t cc;
-				c = tab_beginning; setcchar(&cc, &c, 0, 0, 0);
-				mvwadd_wch(win, y, x++, &cc);
-				c = tab_character; setcchar(&cc, &c, 0, 0, 0);
-				for (j = 0; j < tab_width-1; ++j) {
-					mvwadd_wch(win, y, x, &cc);
-					x++;
-				}
-			}
-			break;
-			default:
-			{
-				cchar_t cc;
-				setcchar(&cc, &c, 0, 0, NULL);
-				mvwadd_wch(win, y, x, &cc);
-				x++;
-			}
-			break;
+		if (tab) {
+			run[len++] = tab_beginning;
+			for (j = 1; j < w; ++j)
+				run[len++] = tab_character;
+		} else {
+			run[len++] = c;
 		}
-		wattroff(win, COLOR_PAIR(PAIR_BUFFER_CONTENTS));
+		pos += w;
+		nx = x + w;
 	}
+	if (len) mvwaddnwstr(win, y + ry, rx, run, len);
+	wattrset(win, base);
 }
 
 void mpaintbuf(struct Buffer *buf, WINDOW *win, bool numbers) {
-	int i, cp;
-	int row;
-	struct Line *ln;
+	int i, j, n, row, rows;
+	int y = buf->cursor.c.y;
+	int wrap = soft_wrap && buf != cmdbuf ? max(getmaxx(win) - buf->offsetx, 1) : 0;
+	struct Line *ln = NULL;
+	char num[16];
+
+	/* Line numbers are relative to the cursor, so they all change with it */
+	bool gutter = numbers && line_numbers && buf->painty != y;
+
+	/* The selection in order, from its first character to its last */
+	struct Coord s = buf->cursor.v0, e = buf->cursor.v1;
+	if (e.y < s.y || (e.y == s.y && e.x < s.x)) SWAP(s, e, struct Coord);
+
+	/* Lines are laid out again when the width changes. The cursor may
+	 * have moved onto another row of its line since it was scrolled to. */
+	if (wrap != buf->wrap) {
+		buf->wrap = wrap;
+		mdirty(buf, 0, INT_MAX);
+	}
+	if (wrap) mscroll(buf);
 
-	if (!buf->curline) return;
-	
 	row = getmaxy(win);
-	cp = buf->cursor.c.y - buf->starty;
+	if (buf->starty != buf->paintstarty || buf->startrow != buf->paintstartrow)
+		mdirty(buf, 0, INT_MAX);
+
+	/* Repaint the rows of dirty lines, and only the numbers of the others */
+	for (i = 0, n = buf->starty; i < row; ++n, i += rows) {
+		int sel0 = 0, sel1 = 0, row0 = n == buf->starty ? buf->startrow : 0;
+		if (n == max(buf->starty, 0)) ln = mgetline(buf, n);
+		else if (ln) ln = mnext(buf, ln);
+		if (s.y >= 0 && n >= s.y && n <= e.y) {
+			sel0 = n == s.y ? s.x : 0;
+			sel1 = n == e.y ? e.x + 1 : INT_MAX;
+		}
 
-	/* Paint from the cursor to the bottom */
-	for (i = cp, ln = buf->curline; i < row && ln; ++i, ln = ln->next)
-		mpaintln(buf, ln, win, i, i - cp, numbers);
+		/* Everything below moves when a line gets more or fewer rows */
+		rows = 1;
+		if (ln) {
+			int old = ln->rows;
+			rows = mrows(buf, ln) - row0;
+			if (ln->rows != old && n >= buf->dirty0 && n <= buf->dirty1)
+				mdirty(buf, n, INT_MAX);
+		}
 
-	/* Paint from the cursor to the top */
-	for (i = cp, ln = buf->curline; i >= 0 && ln; --i, ln = ln->prev)
-		mpaintln(buf, ln, win, i, cp - i, numbers);
+		if (n >= buf->dirty0 && n <= buf->dirty1) {
+			for (j = i; j < i + rows && j < row; ++j) {
+				wmove(win, j, 0);
+				wclrtoeol(win);
+			}
+			if (ln) mpaintln(buf, ln, win, i, row0, abs(n - y), numbers, sel0, sel1);
+		} else if (gutter && ln) {
+			if (snprintf(num, sizeof(num), "%d", abs(n - y)) < buf->offsetx) {
+				if (!row0) mpaintnum(buf, win, i, abs(n - y));
+			} else {
+				mpaintln(buf, ln, win, i, row0, abs(n - y), numbers, sel0, sel1);
+			}
+		}
+	}
 
-	wrefresh(win);
+	buf->dirty0 = INT_MAX;
+	buf->dirty1 = INT_MIN;
+	buf->painty = y;
+	buf->paintstarty = buf->starty;
+	buf->paintstartrow = buf->startrow;
+	wnoutrefresh(win);
 }
 
 void mpaintcmd() {
+	static int lastcnt = -1;
 	int bufsize;
 	int col;
 	char textbuf[32];
 
+	if (!fullpaint && cmdbuf->dirty0 > cmdbuf->dirty1 && repcnt == lastcnt) return;
+	lastcnt = repcnt;
+
 	col = getmaxx(cmdwin);
+	werase(cmdwin);
+	mdirty(cmdbuf, 0, INT_MAX);
 
 	if (use_colors) wattron(cmdwin, COLOR_PAIR(PAIR_STATUS_HIGHLIGHT));
 
@@ -771,53 +1171,96 @@ void mpaintcmd() {
 	mvwprintw(cmdwin, 0, col - bufsize, "%s", textbuf);
 
 	if (use_colors) wattroff(cmdwin, COLOR_PAIR(PAIR_STATUS_HIGHLIGHT));
-	wrefresh(cmdwin);
+	wnoutrefresh(cmdwin);
 }
 
 void resize() {
 	int row, col;
+	if (scripting) return;
 	getmaxyx(stdscr, row, col);
+
+	/* Keep the windows if their size did not change */
+	if (cmdwin && getmaxx(cmdwin) == col && getmaxy(cmdwin) == cmdbuf->numlines
+			&& getmaxy(bufwin) == row - cmdbuf->numlines - 1)
+		return;
+
 	if (statuswin) delwin(statuswin);
 	if (cmdwin) delwin(cmdwin);
 	if (bufwin) delwin(bufwin);
 	statuswin = newwin(1, col, 0, 0);
 	bufwin = newwin(row - cmdbuf->numlines - 1, col, 1, 0);
 	cmdwin = newwin(cmdbuf->numlines, col, row - cmdbuf->numlines, 0);
+	viewrows = getmaxy(bufwin);
+	fullpaint = true;
 }
 
 void repaint() {
-	werase(bufwin);
-	werase(statuswin);
-	werase(cmdwin);
-	refresh();
+	/* Only the parts that changed since the last frame are drawn */
+	static struct Buffer *lastbuf;
+	uint64_t start = mnow(), t;
+
+	if (always_centered) coc();
+	if (fullpaint || curbuf != lastbuf) {
+		/* Flush stdscr too, or reading a key would redraw it over us */
+		if (fullpaint) wnoutrefresh(stdscr);
+		mdirty(curbuf, 0, INT_MAX);
+		lastbuf = curbuf;
+	}
+
+	t = mnow();
 	mpaintstat();
+	t = mlap(STAGE_PAINTSTAT, t);
 	mpaintcmd();
-	if (always_centered) coc();
+	t = mlap(STAGE_PAINTCMD, t);
 	mpaintbuf(curbuf, bufwin, true);
+	mlap(STAGE_PAINTBUF, t);
 	mupdatecursor();
+	doupdate();
+	mlap(STAGE_PAINT, start);
+	fullpaint = false;
 }
 
 void handlemouse() {
 	MEVENT ev;
 	if (getmouse(&ev) == OK) {
 		if (ev.bstate & BUTTON1_CLICKED) {
-			/* Jump to mouse location */
-			int x = ev.x, y = ev.y;
+			/* Jump to mouse location, finding the line on that row */
+			struct Line *ln;
+			int x = ev.x, y = ev.y, n = max(curbuf->starty, 0);
 			wmouse_trafo(bufwin, &y, &x, FALSE);
-			x -= curbuf->cursor.c.x + curbuf->offsetx + 1;
-			y -= curbuf->cursor.c.y + curbuf->starty;
-			mmove(curbuf, x, y);
+			if (!(ln = mgetline(curbuf, n))) return;
+			y += curbuf->starty < 0 ? curbuf->starty : curbuf->startrow;
+			while (y >= mrows(curbuf, ln) && ln->next) {
+				y -= mrows(curbuf, ln);
+				ln = mnext(curbuf, ln);
+				n++;
+			}
+			x = max(x - curbuf->offsetx, 0) + min(y, mrows(curbuf, ln) - 1) * curbuf->wrap;
+			mmove(curbuf, mcolidx(curbuf, ln, x) - curbuf->cursor.c.x, n - curbuf->cursor.c.y);
 		}
 	}
 }
 
 void quit() {
-	struct Buffer *buf = curbuf;
-	do mfreebuf(buf); while((buf = buf->next));
+	FILE *fp;
+	if (scripting) {
+		/* Scripts stop working on the file instead */
+		halted = true;
+		return;
+	}
+	if (stats_path && (fp = fopen(stats_path, "w"))) {
+		mprintstats(fp);
+		fclose(fp);
+	}
+	mjobstop();
+	while (buffers.len)
+		mfreebuf(buffers.list[buffers.len - 1]);
+	mfreebuf(cmdbuf);
 	delwin(cmdwin);
 	delwin(bufwin);
 	delwin(statuswin);
 	endwin();
+	if (bracketed_paste) fputs("\033[?2004l", stderr);
 	exit(0);
 }
 
@@ -830,103 +1273,67 @@ void setmode(const struct Action *ac) {
 	}
 }
 
-void save(const struct Action *ac) {
-	FILE *src, *bak;
-	struct Line *ln;
-
-	if (!ac->arg.v && !curbuf->path) return;
-	if (backup_on_write
-			&& (bak = fopen(backup_path, "w+"))
-			&& (src = fopen(curbuf->path, "r"))) {
-		char c;
-		while((c = getc(src)) != EOF)
-			fputc(c, bak);
-
-		fclose(bak);
-		fclose(src);
-	}
-	if (!(src = fopen(ac->arg.v ? ac->arg.v : curbuf->path, "w+"))) return;
-	for (ln = mfirstline(curbuf); ln; ln = ln->next) {
-		fputws(ln->data, src);
-		if (ln->next) fputws(L"\n", src);
-	}
-
-	fclose(src);
-}
-
 void readfile(const struct Action *ac) {
-	mreadfile((curbuf = mnewbuf()), ac->arg.v);
+	mreadfile((curbuf = mnewbuf(true)), ac->arg.v);
 }
 
-void readstr(const struct Action *ac) {
-	mreadstr(curbuf, (char*)ac->arg.v);
+void readstr(const struct Action *ac, int n) {
+	if (ac->arg.v) minsertrep(curbuf, ac->arg.v, strlen(ac->arg.v), n);
 }
 
-void print(const struct Action *ac) {
-	mreadstr(cmdbuf, (char*)ac->arg.v);
+void print(const struct Action *ac, int n) {
+	/* Scripts print whole lines */
+	while (n--) {
+		mreadstr(cmdbuf, (char*)ac->arg.v);
+		if (scripting) mreadstr(cmdbuf, "\n");
+	}
 	resize();
 }
 
-void find(const struct Action *ac) {
-	if (ac->arg.v) {
-		char msgbuf[100];
-		regex_t reg;
-		struct Line *ln, *prev_ln = curbuf->curline;
-		int i, x, y = 0, wrapped = 0;
-
-		if ((i = regcomp(&reg, ac->arg.v, 0))) {
-			regerror(i, &reg, msgbuf, sizeof(msgbuf));
-			return;
-		}
+void recover() {
+	/* Replay what a crashed session left in the swap file */
+	char msg[256];
+	int n = mrecover(curbuf);
+	if (n < 0) snprintf(msg, sizeof(msg), "Nothing to recover, or the buffer was changed\n");
+	else snprintf(msg, sizeof(msg), "%s: recovered %d edits\n", curbuf->path, n);
+	mreadstr(cmdbuf, msg);
+	resize();
+}
 
-		for (ln = curbuf->curline; ln; ln = ln->next, ++y) {
-			int lineoff = curbuf->cursor.c.x;
-			char buf[default_linebuf_size * 4];
-			const wchar_t *wdat = ln->data + lineoff * sizeof(wchar_t);
-			regmatch_t match;
-
-			wcsrtombs(buf, &wdat, sizeof(buf), NULL);
-			i = regexec(&reg, buf, 1, &match, 0);
-			x = match.rm_so - curbuf->cursor.c.x + lineoff;
-			if (!i) {
-				/* Jump to location, select match */
-				int mx = x + curbuf->cursor.c.x;
-				int my = y + curbuf->cursor.c.y - curbuf->starty;
-				mmove(curbuf, x, y);
-				mselect(curbuf, mx, my, mx + match.rm_eo - match.rm_so - 1, my);
-				regfree(&reg);
-				return;
-			}
-			if (!ln->next && !wrapped) {
-				/* Wrap to beginning of buffer, but only once */
-				ln = curbuf->curline = mfirstline(curbuf);
-				y = 0;
-				wrapped = 1;
-			}
-		}
-		/* If we didn't find a match, do nothing */
-		curbuf->curline = prev_ln;
-		regfree(&reg);
+void save(const struct Action *ac) {
+	const char *path = ac->arg.v ? ac->arg.v : curbuf->path;
+	char msg[256];
+	if (!msave(curbuf, path)) {
+		snprintf(msg, sizeof(msg), "%s: %s\n", path ? path : "write", path ? strerror(errno) : "No file name");
+		mreadstr(cmdbuf, msg);
+		resize();
 	}
 }
 
+void find(const struct Action *ac, int n) {
+	/* Without an argument, search for the last pattern again */
+	const char *src = ac->arg.v ? ac->arg.v : pattern.src;
+	while (n-- && src && mfind(curbuf, src));
+}
+
 void listbuffers() {
-	struct Buffer *buf = curbuf;
-	int i = 0;
-	do {
+	int i;
+	for (i = 0; i < buffers.len; ++i) {
+		struct Buffer *buf = buffers.list[i];
 		char str[64];
 		snprintf(
 			str,
 			sizeof(str),
 			buf == curbuf ? "*%d %s\n" : " %d %s\n",
-			i, buf->path);
+			i, buf->path ? buf->path : "~scratch~");
 		mreadstr(cmdbuf, str);
-		i++;
-	} while((buf = buf->next));
+	}
 }
 
-void motion(const struct Action *ac) {
-	mmove(curbuf, ac->arg.x, ac->arg.y);
+void motion(const struct Action *ac, int n) {
+	/* Large counts move to the end at most */
+	long x = (long)ac->arg.x * n, y = (long)ac->arg.y * n;
+	mmove(curbuf, max(min(x, 1<<30), -(1<<30)), max(min(y, 1<<30), -(1<<30)));
 }
 
 void jump(const struct Action *ac) {
@@ -935,18 +1342,17 @@ void jump(const struct Action *ac) {
 
 void coc() {
 	/* Center on cursor */
-	int row = getmaxy(bufwin);
-	curbuf->starty = -(row / 2 - curbuf->cursor.c.y);
+	mscrollto(curbuf, getmaxy(bufwin) / 2);
 }
 
-void pgup() {
-	int row = getmaxy(bufwin)-1;
-	mmove(curbuf, 0, -row);
+void pgup(const struct Action *ac, int n) {
+	(void)ac;
+	mmove(curbuf, 0, -mpage(curbuf, -1, n));
 }
 
-void pgdown() {
-	int row = getmaxy(bufwin)-1;
-	mmove(curbuf, 0, +row);
+void pgdown(const struct Action *ac, int n) {
+	(void)ac;
+	mmove(curbuf, 0, +mpage(curbuf, +1, n));
 }
 
 void cls() {
@@ -954,28 +1360,73 @@ void cls() {
 	resize();
 }
 
-void bufsel(const struct Action *ac) {
-	/* TODO: Forward/backward multiple buffers */
-	/*if (ac->arg.i < 0) {
-		if (curbuf->prev) curbuf = curbuf->prev;
-	} else if (ac->arg.i > 0) {
-		if (curbuf->next) curbuf = curbuf->next;
-	}*/
+void bufsel(const struct Action *ac, int n) {
+	/* Forward/backward n buffers, wrapping around at the ends */
+	int i = (curbuf->idx + ac->arg.i * (n % buffers.len)) % buffers.len;
+	curbuf = buffers.list[i < 0 ? i + buffers.len : i];
+}
+
+void bufnum(const struct Action *ac) {
+	/* Select a buffer by its number in the list */
+	int i = ac->arg.v ? atoi(ac->arg.v) : -1;
+	if (i >= 0 && i < buffers.len) curbuf = buffers.list[i];
 }
 
-void bufdel(const struct Action *ac) {
+void bufdel(const struct Action *ac, int n) {
 	if (!ac->arg.i) {
-		mfreebuf(curbuf);
+		while (n-- && curbuf) {
+			if (job.buf == curbuf) mjobstop();
+			mfreebuf(curbuf);
+		}
+		if (!curbuf) curbuf = mnewbuf(true);
+		fullpaint = true;
 		resize();
 	}
 }
 
-void insert(const struct Action *ac) {
-	minsert(curbuf, ac->arg.i);
+void gotoline(const struct Action *ac) {
+	if (ac->arg.v && curbuf->curline)
+		mmove(curbuf, 0, atoi(ac->arg.v) - mlineno(curbuf->curline));
+}
+
+void insert(const struct Action *ac, int n) {
+	if (ac->arg.i == KEY_DC) {
+		mdelchars(curbuf, +n);
+	} else if (ac->arg.i == KEY_BACKSPACE) {
+		mdelchars(curbuf, -n);
+	} else {
+		char c[4];
+		minsertrep(curbuf, c, mutf8enc(ac->arg.i, c), n);
+	}
 }
 
-void freeln() {
-	mfreeln(curbuf, curbuf->curline);
+void freeln(const struct Action *ac, int n) {
+	/* The lines go together with one of the newlines around them */
+	struct Line *ln = curbuf->curline;
+	int y = curbuf->cursor.c.y;
+	size_t len = 0;
+	(void)ac;
+
+	if (!ln) return;
+	n = min(n, curbuf->numlines - y);
+	if (y + n < curbuf->numlines) {
+		for (; n--; ln = mnext(curbuf, ln))
+			len += ln->len + 1;
+		mcut(curbuf, y, 0, len);
+	} else if (y) {
+		struct Line *prev = mprev(curbuf, ln);
+		for (; n--; ln = ln->next ? mnext(curbuf, ln) : NULL)
+			len += ln->len + 1;
+		mcut(curbuf, y - 1, prev->len, len);
+	} else {
+		/* Nothing is left, not even an empty line */
+		for (; n--; ln = ln->next ? mnext(curbuf, ln) : NULL)
+			len += ln->len + 1;
+		mcut(curbuf, 0, 0, len - 1);
+		mfreeln(curbuf, curbuf->curline);
+	}
+	if (curbuf->curline) curbuf->cursor.c.y = mlineno(curbuf->curline);
+	mmove(curbuf, 0, 0);
 }
 
 void append() {
@@ -983,8 +1434,118 @@ void append() {
 	mode = MODE_INSERT;
 }
 
-void newln() {
+void newln(const struct Action *ac, int n) {
+	/* The other lines get the same indentation as the first */
+	(void)ac;
 	mjump(curbuf, MARKER_END);
 	minsert(curbuf, L'\n');
+	if (n > 1) {
+		struct Line *ln = curbuf->curline;
+		char *text = malloc(ln->len + 1);
+		assert(text);
+		text[0] = '\n';
+		memcpy(text + 1, ln->data, ln->len);
+		minsertrep(curbuf, text, ln->len + 1, n - 1);
+		free(text);
+	}
 	mode = MODE_INSERT;
 }
+
+void undo(const struct Action *ac, int n) {
+	while (n--)
+		mundo(curbuf, ac->arg.i > 0);
+}
+
+void again(const struct Action *ac, int n) {
+	/* Replay the last command line, which may contain again itself */
+	static bool replaying;
+	(void)ac;
+	if (replaying) return;
+	replaying = true;
+	while (n--)
+		mrunchain(&chain);
+	replaying = false;
+}
+
+void stats(const struct Action *ac) {
+	/* Show the latency of each stage, or write it to a file */
+	char *s = NULL, msg[256];
+	size_t len = 0;
+	FILE *fp = ac->arg.v ? fopen(ac->arg.v, "w") : open_memstream(&s, &len);
+
+	if (!fp) {
+		snprintf(msg, sizeof(msg), "%s: %s\n", (char*)ac->arg.v, strerror(errno));
+		mreadstr(cmdbuf, msg);
+	} else {
+		mprintstats(fp);
+		fclose(fp);
+		if (s) mreadstr(cmdbuf, s);
+		free(s);
+	}
+	resize();
+}
+
+void cut(const struct Action *ac) {
+	struct Coord a;
+	size_t off, len;
+	(void)ac;
+
+	if (!myank(&a, &off, &len)) return;
+	mcut(curbuf, a.y, off, len);
+	mselend(a.x, a.y);
+}
+
+void yank(const struct Action *ac) {
+	struct Coord a;
+	size_t off, len;
+	(void)ac;
+
+	if (myank(&a, &off, &len)) mselend(a.x, a.y);
+}
+
+void put(const struct Action *ac, int n) {
+	(void)ac;
+	if (!reg.len) return;
+	minsertrep(curbuf, reg.text, reg.len, n);
+	mmove(curbuf, 0, 0);
+}
+
+void shift(const struct Action *ac, int n) {
+	/* Indent or dedent the selected lines by n levels */
+	struct Coord a, b;
+	if (!mselection(&a, &b)) return;
+	mshift(curbuf, a.y, b.y, ac->arg.i * n);
+	mselend(0, a.y);
+}
+
+void pipesel(const struct Action *ac) {
+	/* Send the selected lines through a shell command, its output takes
+	 * their place. Without a command, the last one is used again. */
+	static const struct Action out = { NULL, 0, readstr, {{ 0 }} };
+	static char *last;
+	struct Coord a, b;
+	char *text;
+	size_t len;
+	FILE *fp;
+
+	if (ac->arg.v) {
+		free(last);
+		last = strdup(ac->arg.v);
+	}
+	if (!last || !mselection(&a, &b) || !(fp = tmpfile())) return;
+
+	text = mcopy(curbuf, a.y, 0, mbytes(curbuf, a.y, 0, b.y, mgetline(curbuf, b.y)->len), &len);
+	fwrite(text, 1, len, fp);
+	fputc('\n', fp);
+	free(text);
+	if (fflush(fp) || fseek(fp, 0, SEEK_SET)) {
+		fclose(fp);
+		return;
+	}
+
+	/* The output streams into the line the selection leaves behind */
+	mcut(curbuf, a.y, 0, len);
+	mselend(0, a.y);
+	mjobstart(last, &out, 1, fileno(fp));
+	fclose(fp);
+}
@@ -0,0 +1,268 @@
+/* Editing core of mett, shared by the editor and the benchmarks. Nothing
+ * in here needs a terminal. */
+#include <curses.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include <wchar.h>
+
+#define SWAP(X, Y, T) { T SWAP = X; X = Y; Y = SWAP; }
+
+enum Mode {
+	MODE_NORMAL,
+	MODE_INSERT,
+	MODE_SELECT,
+	MODE_COMMAND
+};
+
+enum Marker {
+	MARKER_START,
+	MARKER_MIDDLE,
+	MARKER_END
+};
+
+struct Coord {
+	int x, y;
+};
+
+struct Cursor {
+	struct Coord c; /* Cursor coordinate */
+	struct Coord v0; /* Visual selection start */
+	struct Coord v1; /* Visual selection end */
+};
+
+struct Line {
+	struct Line *next, *prev;
+	struct Line *parent, *left, *right; /* Position in the line index */
+	int weight; /* Number of lines in this subtree of the index */
+	unsigned prio;
+	size_t backbuf_size; /* 0 if data points into a read-only region */
+	size_t len; /* Length of data in bytes */
+	int nchars; /* Length of data in characters, or number of lines of a span */
+	bool ascii;
+	bool span; /* Stands for nchars lines of a mapped file that were not needed yet */
+	struct Cols *cols; /* Column checkpoints of a long line, NULL until needed */
+	int rows, rowswrap; /* Screen rows when wrapped at rowswrap columns, which is 0 once edited */
+	char *data; /* UTF-8, NUL terminated (spans are not) */
+	char buf[];
+};
+
+struct Cols {
+	struct Cols *prev, *next; /* All of a buffer's, so they go with its pool */
+	int n, size; /* Checkpoints that are still right, and room for them */
+	int wrap; /* Wrap width the columns were counted for */
+	struct {
+		size_t off;
+		int col;
+	} marks[]; /* Byte offset and screen position of every COL_STEP-th character */
+};
+
+struct Region {
+	struct Region *next;
+	size_t len;
+	char *data; /* Points to buf, or to the mapped file */
+	size_t *marks; /* Offsets of every MARK_STEP-th line of a mapped file */
+	size_t nmarks;
+	char buf[];
+};
+
+struct Edit {
+	struct Edit *prev, *next;
+	unsigned seq; /* Edits made by the same command are undone together */
+	bool insert; /* Text was inserted, otherwise it was deleted */
+	int y, ey; /* Line of the first and last byte */
+	size_t off, eoff; /* Byte offset of the first byte and after the last one */
+	size_t len;
+	char text[];
+};
+
+struct Chunk {
+	struct Chunk *prev, *next;
+	size_t len, size;
+	char data[];
+};
+
+/* Size classes of line storage, class c holds 8 << c bytes of text
+ * (nothing for lines that borrow their text) */
+#define LINE_CLASSES 14
+
+/* Mapped files remember where every MARK_STEP-th line starts */
+#define MARK_STEP 1024
+
+/* Lines of at least 2*COL_STEP characters remember the display column of
+ * every COL_STEP-th character */
+#define COL_STEP 256
+
+struct Pool {
+	struct Chunk *chunks; /* Blocks the lines are carved from */
+	struct Chunk *large; /* Lines too large for any class, one per chunk */
+	struct Cols *cols; /* Column checkpoints of the lines */
+	struct Line *free[LINE_CLASSES]; /* Freed lines of each class, linked by next */
+};
+
+struct Journal {
+	struct Chunk *head, *tail; /* Arena the edits are allocated from */
+	struct Edit *last; /* Last edit that has not been undone */
+	size_t size;
+};
+
+struct Buffer {
+	char *path;
+	int idx; /* Position in the buffer table, -1 if it isn't listed */
+	struct Region *regions; /* Original text of the files read into the buffer */
+	struct Line *root; /* Line index (a treap ordered like the list) */
+	struct Line *curline;
+	struct Cursor cursor;
+	int starty;
+	int startrow; /* Screen rows of line starty that are scrolled off the top */
+	int offsetx;
+	int wrap; /* Columns lines are wrapped at, 0 if they are cut off */
+	int numlines;
+	int dirty0, dirty1; /* Range of lines that need to be repainted */
+	unsigned gen; /* Changes whenever lines are linked, unlinked or moved */
+	int painty, paintstarty, paintstartrow; /* Cursor and scroll position when last painted */
+	struct Journal journal;
+	unsigned changes; /* Edits since the file was read or saved, undone ones too */
+	struct Pool pool;
+	struct SwapFile *swap; /* Crash recovery journal, NULL if there is none */
+};
+
+struct Buffers {
+	struct Buffer **list; /* Listed buffers in the order they were opened */
+	int len, size;
+};
+
+struct SwapFile {
+	struct SwapFile *next;
+	char *path;
+	int fd; /* -1 until the first edit */
+	off_t fsize; /* Version of the file the edits apply to */
+	struct timespec fmtime;
+	char *data; /* Records the flush thread hasn't written yet */
+	size_t len, size;
+	bool busy; /* The flush thread is writing records out */
+	bool stale; /* A crashed session's journal is waiting for mrecover */
+};
+
+struct Swaps {
+	pthread_mutex_t lock; /* Guards the list and every file's records */
+	pthread_cond_t idle; /* Signalled when a file is no longer busy */
+	pthread_t thread;
+	bool started;
+	struct SwapFile *list;
+};
+
+struct Feed {
+	struct Feed *next;
+	int fd; /* Pipe that is read while editing */
+	struct Buffer *buf; /* Buffer the data is appended to */
+	size_t total; /* Bytes read so far */
+	char part[4]; /* Start of a character split between two reads */
+	size_t npart;
+};
+
+struct Pattern {
+	char *src; /* Source of the compiled pattern, NULL if none */
+	regex_t reg;
+	char lit[256]; /* Literal every match must contain */
+	size_t litlen;
+};
+
+struct Iter {
+	struct Line *ln; /* Line or span the iterator is in */
+	int y, k; /* Line number, and index of the line in the span */
+	const char *p; /* Text of the line, not NUL terminated */
+	size_t len;
+	unsigned gen; /* Buffer generation ln is valid for */
+};
+
+struct Search {
+	char *src; /* Pattern typed so far, NULL if not searching */
+	bool valid; /* src compiled */
+	struct Buffer *buf;
+	struct Cursor from; /* Cursor before the search, lines are counted from here */
+	struct Iter it; /* Next line to scan... */
+	int pos; /* ...and its index */
+	int *hits, nhits, nhitsize; /* Indices of the lines that matched */
+	int *cand, ncand, ncandsize, icand; /* Matches of the shorter pattern left to check */
+	bool found;
+};
+
+/* core.c */
+int32_t min(int32_t, int32_t);
+int32_t max(int32_t, int32_t);
+
+struct Buffer* mnewbuf(bool);
+void mfreebuf(struct Buffer*);
+void mclearbuf(struct Buffer*);
+int  mreadfile(struct Buffer*, const char*);
+void mreadstr(struct Buffer*, const char*);
+
+void mfreeln(struct Buffer*, struct Line*);
+struct Line* mfirstline(struct Buffer*);
+struct Line* mgetline(struct Buffer*, int);
+struct Line* mnext(struct Buffer*, struct Line*);
+struct Line* mprev(struct Buffer*, struct Line*);
+int  mlineno(struct Line*);
+size_t mutf8len(const char*);
+size_t mutf8dec(const char*, wchar_t*);
+size_t mutf8enc(wint_t, char*);
+size_t mutf8tail(const char*, size_t);
+size_t moffset(struct Line*, int);
+int  mcharidx(struct Line*, size_t);
+int  mnumcols(struct Buffer*, struct Line*, int);
+int  mcolidx(struct Buffer*, struct Line*, int);
+int  mwidth(wchar_t);
+int  mplace(int, int, int);
+int  mrows(struct Buffer*, struct Line*);
+int  mrowsabove(struct Buffer*, int);
+void mscroll(struct Buffer*);
+int  mpage(struct Buffer*, int, int);
+void mscrollto(struct Buffer*, int);
+void minsert(struct Buffer*, wint_t);
+void minsertstr(struct Buffer*, const char*, size_t);
+void mmove(struct Buffer*, int, int);
+void mjump(struct Buffer*, enum Marker);
+void mselect(struct Buffer*, int, int, int, int);
+void mdirty(struct Buffer*, int, int);
+bool mfeedread();
+bool mcompile(const char*);
+void msearchhit(int);
+void msearchback();
+void msearchrestart();
+bool msearchstep();
+void msearchend();
+void mundo(struct Buffer*, bool);
+int  mrecover(struct Buffer*);
+char* mcopy(struct Buffer*, int, size_t, size_t, size_t*);
+size_t mbytes(struct Buffer*, int, size_t, int, size_t);
+void mcut(struct Buffer*, int, size_t, size_t);
+void mshift(struct Buffer*, int, int, int);
+void mdelchars(struct Buffer*, int);
+void minsertrep(struct Buffer*, const char*, size_t, int);
+bool mfind(struct Buffer*, const char*);
+bool msave(struct Buffer*, const char*);
+
+/* Settings of the core the editor needs too, see config.h */
+extern bool auto_indent;
+extern bool backup_on_write;
+extern bool swap_files;
+extern const size_t file_block_size;
+extern const unsigned tab_width;
+extern const size_t job_read_budget;
+
+/* State of the editor */
+extern enum Mode mode;
+extern struct Buffer *curbuf, *cmdbuf;
+extern struct Buffers buffers;
+extern struct Feed *feeds;
+extern struct Pattern pattern;
+extern struct Search search;
+extern unsigned editseq;
+extern bool undoing;
+extern bool dying;
+extern int viewrows;